@@ -0,0 +1,264 @@
+/*  bench_codec.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Microbenchmark for the hex codec. Compares hex_encode() and hex_decode() against the snprintf()
+ * and sscanf() based code they replaced, for public keys and Tox IDs.
+ *
+ * Build and run with `make bench-codec`.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/codec.h"
+
+#define PUBLIC_KEY_SIZE 32
+#define ADDRESS_SIZE 38
+#define NUM_KEYS 1024
+#define ITERATIONS 2000
+
+static uint8_t keys[NUM_KEYS][ADDRESS_SIZE];
+
+/* Room for the old decoder, which reads past the end of its input */
+static char hex_keys[NUM_KEYS][ADDRESS_SIZE * 4 + 1];
+
+static volatile uint8_t sink;
+
+/* The Tox ID encoder previously used by cmd_id() */
+static void old_encode(char *hex, const uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; ++i) {
+        char d[3];
+        sprintf(d, "%02X", data[i] & 0xff);
+        memcpy(hex + i * 2, d, 2);
+    }
+
+    hex[length * 2] = '\0';
+}
+
+/* The decoder previously used for bootstrap nodes */
+static char *old_hex_string_to_bin(const char *hex_string)
+{
+    size_t len = strlen(hex_string);
+    char *val = malloc(len);
+
+    if (val == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < len; ++i, hex_string += 2) {
+        sscanf(hex_string, "%2hhx", &val[i]);
+    }
+
+    return val;
+}
+
+static int old_hex_digit_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
+
+/* The decoder previously used for key lists and command arguments */
+static int old_hex_string_to_public_key(const char *hex_string, uint8_t *public_key)
+{
+    for (size_t i = 0; i < PUBLIC_KEY_SIZE; ++i) {
+        int hi = old_hex_digit_value(hex_string[i * 2]);
+        int lo = hi == -1 ? -1 : old_hex_digit_value(hex_string[i * 2 + 1]);
+
+        if (lo == -1) {
+            return -1;
+        }
+
+        public_key[i] = (uint8_t) ((hi << 4) | lo);
+    }
+
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double start, size_t ops)
+{
+    printf("  %-32s %8.1f ns/op\n", name, (now() - start) * 1e9 / ops);
+}
+
+static void bench_encode(size_t length)
+{
+    char hex[ADDRESS_SIZE * 2 + 1];
+    double start = now();
+
+    for (size_t n = 0; n < ITERATIONS; ++n) {
+        for (size_t i = 0; i < NUM_KEYS; ++i) {
+            old_encode(hex, keys[i], length);
+            sink ^= hex[i % (length * 2)];
+        }
+    }
+
+    report("encode (sprintf)", start, ITERATIONS * NUM_KEYS);
+
+    start = now();
+
+    for (size_t n = 0; n < ITERATIONS; ++n) {
+        for (size_t i = 0; i < NUM_KEYS; ++i) {
+            hex_encode(hex, keys[i], length);
+            sink ^= hex[i % (length * 2)];
+        }
+    }
+
+    report("encode (hex_encode)", start, ITERATIONS * NUM_KEYS);
+}
+
+static void bench_decode(size_t length)
+{
+    uint8_t data[ADDRESS_SIZE];
+    double start;
+
+    if (length == PUBLIC_KEY_SIZE) {
+        start = now();
+
+        for (size_t n = 0; n < ITERATIONS; ++n) {
+            for (size_t i = 0; i < NUM_KEYS; ++i) {
+                old_hex_string_to_public_key(hex_keys[i], data);
+                sink ^= data[i % length];
+            }
+        }
+
+        report("decode (hex_string_to_public_key)", start, ITERATIONS * NUM_KEYS);
+    }
+
+    /* sscanf is slow enough that fewer iterations give a stable figure */
+    start = now();
+
+    for (size_t n = 0; n < ITERATIONS / 20; ++n) {
+        for (size_t i = 0; i < NUM_KEYS; ++i) {
+            char saved = hex_keys[i][length * 2];
+            hex_keys[i][length * 2] = '\0';
+            char *bin = old_hex_string_to_bin(hex_keys[i]);
+            hex_keys[i][length * 2] = saved;
+            sink ^= bin[i % length];
+            free(bin);
+        }
+    }
+
+    report("decode (hex_string_to_bin)", start, ITERATIONS / 20 * NUM_KEYS);
+
+    start = now();
+
+    for (size_t n = 0; n < ITERATIONS; ++n) {
+        for (size_t i = 0; i < NUM_KEYS; ++i) {
+            hex_decode(data, length, hex_keys[i]);
+            sink ^= data[i % length];
+        }
+    }
+
+    report("decode (hex_decode)", start, ITERATIONS * NUM_KEYS);
+}
+
+/* Checks hex_encode() and hex_decode() against the old code, including rejection of bad digits */
+static int verify(void)
+{
+    for (size_t i = 0; i < NUM_KEYS; ++i) {
+        char expected[ADDRESS_SIZE * 2 + 1];
+        char hex[ADDRESS_SIZE * 2 + 1];
+        uint8_t data[ADDRESS_SIZE];
+
+        old_encode(expected, keys[i], ADDRESS_SIZE);
+        hex_encode(hex, keys[i], ADDRESS_SIZE);
+
+        if (strcmp(expected, hex) != 0) {
+            fprintf(stderr, "encode mismatch at key %zu\n", i);
+            return -1;
+        }
+
+        /* mix in lowercase */
+        for (size_t j = i % 3; j < ADDRESS_SIZE * 2; j += 3) {
+            hex[j] = (char) ((hex[j] >= 'A') ? hex[j] | 0x20 : hex[j]);
+        }
+
+        if (hex_decode(data, ADDRESS_SIZE, hex) != 0 || memcmp(data, keys[i], ADDRESS_SIZE) != 0) {
+            fprintf(stderr, "decode mismatch at key %zu\n", i);
+            return -1;
+        }
+
+        static const char bad_chars[] = "/:@G`g \xff";
+        hex[i % (ADDRESS_SIZE * 2)] = bad_chars[i % (sizeof(bad_chars) - 1)];
+
+        if (hex_decode(data, ADDRESS_SIZE, hex) != -1) {
+            fprintf(stderr, "bad digit not rejected at key %zu\n", i);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int main(void)
+{
+    srand(1);
+
+    for (size_t i = 0; i < NUM_KEYS; ++i) {
+        for (size_t j = 0; j < ADDRESS_SIZE; ++j) {
+            keys[i][j] = (uint8_t) rand();
+        }
+
+        old_encode(hex_keys[i], keys[i], ADDRESS_SIZE);
+    }
+
+    if (verify() != 0) {
+        return EXIT_FAILURE;
+    }
+
+    printf("hex codec: %s\n", hex_codec_name());
+
+    printf("public key (%d bytes)\n", PUBLIC_KEY_SIZE);
+    bench_encode(PUBLIC_KEY_SIZE);
+    bench_decode(PUBLIC_KEY_SIZE);
+
+    printf("Tox ID (%d bytes)\n", ADDRESS_SIZE);
+    bench_encode(ADDRESS_SIZE);
+    bench_decode(ADDRESS_SIZE);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,377 @@
+/*  bench_groups.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Microbenchmark for the group registry. Times adding, looking up and leaving groups in the slab and
+ * hash table registry, and compares it against the realloc-per-add array with linear scans it
+ * replaced (minus its 256 group cap). Also times a full scan over the hot group records against the
+ * same scan over the old records, which kept the title and password inline.
+ *
+ * Build and run with `make bench-groups`.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/groupchats.h"
+
+#define NUM_GROUPS 100000
+
+/* The old registry is quadratic in the number of groups, so it's only run on this many */
+#define OLD_NUM_GROUPS 10000
+
+#define SCAN_ROUNDS 100
+
+static volatile uint32_t sink;
+
+/* The group record as it was before titles and passwords were split out */
+struct Old_Group_Chat {
+    uint32_t groupnum;
+    bool active;
+    bool has_pass;
+    uint8_t type;
+    char title[TOX_MAX_NAME_LENGTH];
+    int title_len;
+    char password[MAX_PASSWORD_SIZE];
+};
+
+static struct Old_Group_Chat *old_chats;
+static int old_chats_idx;
+
+static void old_realloc_groupchats(int n)
+{
+    if (n <= 0) {
+        free(old_chats);
+        old_chats = NULL;
+        return;
+    }
+
+    struct Old_Group_Chat *g = realloc(old_chats, n * sizeof(struct Old_Group_Chat));
+
+    if (g == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    old_chats = g;
+}
+
+static int old_group_add(uint32_t groupnum, uint8_t type, const char *password)
+{
+    (void) password;
+
+    old_realloc_groupchats(old_chats_idx + 1);
+    memset(&old_chats[old_chats_idx], 0, sizeof(struct Old_Group_Chat));
+
+    for (int i = 0; i <= old_chats_idx; ++i) {
+        if (old_chats[i].active) {
+            continue;
+        }
+
+        memset(&old_chats[i], 0, sizeof(struct Old_Group_Chat));
+        old_chats[i].groupnum = groupnum;
+        old_chats[i].active = true;
+        old_chats[i].type = type;
+
+        if (old_chats_idx == i) {
+            ++old_chats_idx;
+        }
+
+        return 0;
+    }
+
+    return -1;
+}
+
+static void old_group_leave(uint32_t groupnum)
+{
+    int i;
+
+    for (i = 0; i < old_chats_idx; ++i) {
+        if (old_chats[i].active && old_chats[i].groupnum == groupnum) {
+            memset(&old_chats[i], 0, sizeof(struct Old_Group_Chat));
+            break;
+        }
+    }
+
+    for (i = old_chats_idx; i > 0; --i) {
+        if (old_chats[i - 1].active) {
+            break;
+        }
+    }
+
+    old_chats_idx = i;
+    old_realloc_groupchats(i);
+}
+
+static int old_group_index(uint32_t groupnum)
+{
+    for (int i = 0; i < old_chats_idx; ++i) {
+        if (old_chats[i].active && old_chats[i].groupnum == groupnum) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double start, size_t ops)
+{
+    double secs = now() - start;
+    printf("  %-24s %10.1f ns/op\n", name, secs * 1e9 / ops);
+}
+
+/* Fills `order` with a random permutation of 0 .. count - 1 */
+static void shuffle(uint32_t *order, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; ++i) {
+        order[i] = i;
+    }
+
+    for (uint32_t i = count; i > 1; --i) {
+        uint32_t j = rand() % i;
+        uint32_t tmp = order[i - 1];
+        order[i - 1] = order[j];
+        order[j] = tmp;
+    }
+}
+
+/* The kind of pass the purge makes: visit every active group and read its groupnum and peer count */
+static void bench_scan_old(uint32_t count)
+{
+    old_chats = calloc(count, sizeof(struct Old_Group_Chat));
+
+    if (old_chats == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        old_chats[i].groupnum = i;
+        old_chats[i].active = true;
+    }
+
+    printf("old records, %u groups (%zu bytes each)\n", count, sizeof(struct Old_Group_Chat));
+
+    double start = now();
+
+    for (int r = 0; r < SCAN_ROUNDS; ++r) {
+        uint32_t total = 0;
+
+        for (uint32_t i = 0; i < count; ++i) {
+            if (old_chats[i].active) {
+                total += old_chats[i].groupnum + old_chats[i].type;
+            }
+        }
+
+        sink += total;
+    }
+
+    report("scan", start, (size_t) count * SCAN_ROUNDS);
+
+    free(old_chats);
+    old_chats = NULL;
+}
+
+static int bench_scan_new(uint32_t count)
+{
+    for (uint32_t i = 0; i < count; ++i) {
+        if (group_add(i, 0, i % 2 ? "hunter2" : NULL) != 0) {
+            fprintf(stderr, "group_add failed\n");
+            return -1;
+        }
+
+        group_set_peer_count(i, i % 8);
+    }
+
+    printf("hot records, %u groups (%zu bytes each)\n", count, sizeof(struct Group_Chat));
+
+    uint32_t slots = groups_num_slots();
+    double start = now();
+
+    for (int r = 0; r < SCAN_ROUNDS; ++r) {
+        uint32_t total = 0;
+
+        for (uint32_t i = 0; i < slots; ++i) {
+            const struct Group_Chat *chat = group_at(i);
+
+            if (chat != NULL) {
+                total += chat->groupnum + chat->num_peers;
+            }
+        }
+
+        sink += total;
+    }
+
+    report("scan", start, (size_t) count * SCAN_ROUNDS);
+
+    if (!group_check_password(1, "hunter2") || group_check_password(1, "hunter3") || !group_check_password(2, NULL)) {
+        fprintf(stderr, "password check failed\n");
+        return -1;
+    }
+
+    groups_free();
+
+    return 0;
+}
+
+static void bench_old(const uint32_t *order, uint32_t count)
+{
+    printf("old registry, %u groups\n", count);
+
+    double start = now();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        old_group_add(i, 0, NULL);
+    }
+
+    report("group_add", start, count);
+
+    start = now();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        sink += old_group_index(order[i]);
+    }
+
+    report("group_index", start, count);
+
+    start = now();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        old_group_leave(order[i]);
+    }
+
+    report("group_leave", start, count);
+
+    old_realloc_groupchats(0);
+}
+
+static int bench_new(const uint32_t *order, uint32_t count)
+{
+    printf("slab registry, %u groups\n", count);
+
+    double start = now();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        if (group_add(i, 0, NULL) != 0) {
+            fprintf(stderr, "group_add failed\n");
+            return -1;
+        }
+    }
+
+    report("group_add", start, count);
+
+    start = now();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        const struct Group_Chat *chat = group_get(order[i]);
+
+        if (chat == NULL || chat->groupnum != order[i]) {
+            fprintf(stderr, "group_get(%u) failed\n", order[i]);
+            return -1;
+        }
+
+        sink += chat->type;
+    }
+
+    report("group_get", start, count);
+
+    start = now();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        group_leave(order[i]);
+
+        /* check a group that's still registered after every few deletions */
+        if (i % 16 == 0 && i + 1 < count && group_get(order[i + 1]) == NULL) {
+            fprintf(stderr, "group %u lost after leaving %u\n", order[i + 1], order[i]);
+            return -1;
+        }
+    }
+
+    report("group_leave", start, count);
+
+    if (groups_count() != 0) {
+        fprintf(stderr, "%u groups left over\n", groups_count());
+        return -1;
+    }
+
+    /* freed slots are reused rather than growing the slab */
+    uint32_t slots = groups_num_slots();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        group_add(count + i, 0, NULL);
+    }
+
+    if (groups_num_slots() != slots) {
+        fprintf(stderr, "slab grew from %u to %u slots on re-adding\n", slots, groups_num_slots());
+        return -1;
+    }
+
+    groups_free();
+
+    return 0;
+}
+
+int main(void)
+{
+    uint32_t *order = malloc(NUM_GROUPS * sizeof(uint32_t));
+
+    if (order == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    srand(1);
+
+    shuffle(order, OLD_NUM_GROUPS);
+    bench_old(order, OLD_NUM_GROUPS);
+
+    if (bench_new(order, OLD_NUM_GROUPS) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    shuffle(order, NUM_GROUPS);
+
+    if (bench_new(order, NUM_GROUPS) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    bench_scan_old(NUM_GROUPS);
+
+    if (bench_scan_new(NUM_GROUPS) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    free(order);
+
+    return 0;
+}
@@ -0,0 +1,248 @@
+/*  bench_parse.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Microbenchmark for the command tokenizer. Compares tokenize() against the strdup() and
+ * copy-the-tail based parser it replaced, on inputs of the maximum message length.
+ *
+ * Build and run with `make bench-parse`.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/tokenizer.h"
+
+#define MAX_COMMAND_LENGTH 1372    /* TOX_MAX_MESSAGE_LENGTH */
+#define MAX_NUM_ARGS 4
+#define ITERATIONS 200000
+
+static volatile char sink;
+
+static int old_char_find(int idx, const char *s, char ch)
+{
+    int i = idx;
+
+    for (i = idx; s[i]; ++i) {
+        if (s[i] == ch) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/* The parser previously used by execute() */
+static int old_parse_command(const char *input, char (*args)[MAX_COMMAND_LENGTH])
+{
+    char *cmd = strdup(input);
+
+    if (cmd == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    int num_args = 0;
+    int i = 0;
+
+    while (num_args < MAX_NUM_ARGS) {
+        int qt_ofst = 0;
+
+        if (*cmd == '\"') {
+            qt_ofst = 1;
+            i = old_char_find(1, cmd, '\"');
+
+            if (cmd[i] == '\0') {
+                free(cmd);
+                return -1;
+            }
+        } else {
+            i = old_char_find(0, cmd, ' ');
+        }
+
+        memcpy(args[num_args], cmd, i + qt_ofst);
+        args[num_args++][i + qt_ofst] = '\0';
+
+        if (cmd[i] == '\0') {
+            break;
+        }
+
+        char tmp[MAX_COMMAND_LENGTH];
+        snprintf(tmp, sizeof(tmp), "%s", &cmd[i + 1]);
+        strcpy(cmd, tmp);
+    }
+
+    free(cmd);
+    return num_args;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double start, size_t ops, size_t length)
+{
+    double secs = now() - start;
+    printf("  %-24s %8.1f ns/op %8.1f MB/s\n", name, secs * 1e9 / ops, ops * length / secs / 1e6);
+}
+
+/* Fills `buf` with `prefix` followed by words of filler text up to the maximum message length */
+static size_t make_input(char *buf, const char *prefix, const char *suffix)
+{
+    static const char *words[] = {"lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing", "elit"};
+
+    size_t max = MAX_COMMAND_LENGTH - 1 - strlen(suffix);
+    size_t len = snprintf(buf, MAX_COMMAND_LENGTH, "%s", prefix);
+
+    for (size_t i = 0; len + strlen(words[i % 8]) + 1 <= max; ++i) {
+        len += snprintf(buf + len, MAX_COMMAND_LENGTH - len, "%s%s", i ? " " : "", words[i % 8]);
+    }
+
+    len += snprintf(buf + len, MAX_COMMAND_LENGTH - len, "%s", suffix);
+
+    return len;
+}
+
+/* Checks that tokenize() splits `input` the way the old parser did, apart from dropping quotes */
+static int verify(const char *input, size_t length)
+{
+    char old_args[MAX_NUM_ARGS][MAX_COMMAND_LENGTH];
+    int old_num = old_parse_command(input, old_args);
+
+    /* the old parser produced an empty arg after a closing quote or trailing space; tokenize() skips them */
+    while (old_num > 0 && old_args[old_num - 1][0] == '\0') {
+        --old_num;
+    }
+
+    char buf[MAX_COMMAND_LENGTH];
+    memcpy(buf, input, length + 1);
+
+    struct Token tokens[MAX_NUM_ARGS];
+    int num = tokenize(buf, length, tokens, MAX_NUM_ARGS);
+
+    if (num != old_num) {
+        fprintf(stderr, "token count mismatch: %d != %d\n", num, old_num);
+        return -1;
+    }
+
+    for (int i = 0; i < num; ++i) {
+        const char *expected = old_args[i];
+        size_t expected_len = strlen(expected);
+
+        if (tokens[i].quoted) {
+            ++expected;
+            expected_len -= 2;
+        }
+
+        if (tokens[i].length != expected_len || memcmp(buf + tokens[i].offset, expected, expected_len) != 0
+                || buf[tokens[i].offset + tokens[i].length] != '\0') {
+            fprintf(stderr, "token %d mismatch\n", i);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Checks quote escaping, which the old parser didn't support */
+static int verify_escapes(void)
+{
+    char buf[] = "name \"a \\\"quoted\\\" \\\\ name\" x";
+    struct Token tokens[MAX_NUM_ARGS];
+
+    if (tokenize(buf, strlen(buf), tokens, MAX_NUM_ARGS) != 3 || !tokens[1].quoted
+            || strcmp(buf + tokens[1].offset, "a \"quoted\" \\ name") != 0 || strcmp(buf + tokens[2].offset, "x") != 0) {
+        fprintf(stderr, "escaped quotes mismatch\n");
+        return -1;
+    }
+
+    char unterminated[] = "name \"no closing quote\\\"";
+
+    if (tokenize(unterminated, strlen(unterminated), tokens, MAX_NUM_ARGS) != -1) {
+        fprintf(stderr, "unterminated quote not rejected\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void bench(const char *name, const char *input, size_t length)
+{
+    printf("%s (%zu bytes)\n", name, length);
+
+    char old_args[MAX_NUM_ARGS][MAX_COMMAND_LENGTH];
+    double start = now();
+
+    for (size_t n = 0; n < ITERATIONS; ++n) {
+        int num = old_parse_command(input, old_args);
+        sink ^= old_args[num - 1][0];
+    }
+
+    report("parse_command", start, ITERATIONS, length);
+
+    /* tokenize() works in place, so the copy out of the callback's buffer is part of its cost */
+    char buf[MAX_COMMAND_LENGTH];
+    struct Token tokens[MAX_NUM_ARGS];
+    start = now();
+
+    for (size_t n = 0; n < ITERATIONS; ++n) {
+        memcpy(buf, input, length + 1);
+        int num = tokenize(buf, length, tokens, MAX_NUM_ARGS);
+        sink ^= buf[tokens[num - 1].offset];
+    }
+
+    report("tokenize", start, ITERATIONS, length);
+}
+
+int main(void)
+{
+    static char quoted[MAX_COMMAND_LENGTH];
+    static char words[MAX_COMMAND_LENGTH];
+    static char spaces[MAX_COMMAND_LENGTH];
+
+    size_t quoted_len = make_input(quoted, "gmessage 0 \"", "\"");
+    size_t words_len = make_input(words, "", "");
+
+    /* one short arg followed by a long run of separators, which the old parser copied at every step */
+    size_t spaces_len = MAX_COMMAND_LENGTH - 1;
+    memset(spaces, ' ', spaces_len);
+    memcpy(spaces, "purge", 5);
+    memcpy(spaces + spaces_len - 2, "30", 2);
+    spaces[spaces_len] = '\0';
+
+    if (verify(quoted, quoted_len) != 0 || verify(words, words_len) != 0 || verify_escapes() != 0) {
+        return EXIT_FAILURE;
+    }
+
+    bench("quoted message", quoted, quoted_len);
+    bench("unquoted words", words, words_len);
+    bench("runs of spaces", spaces, spaces_len);
+
+    return 0;
+}
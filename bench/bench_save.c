@@ -0,0 +1,148 @@
+/*  bench_save.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Benchmark for data file saves with 10k friends. Compares writing a plaintext profile, encrypting it
+ * with a cached pass key, and deriving a new key for every save.
+ *
+ * Build and run with `make bench-save`. The profile is written to bench_save.tox in the current directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tox/tox.h>
+#include <tox/toxencryptsave.h>
+
+#include "../src/misc.h"
+#include "../src/saver.h"
+
+#define NUM_FRIENDS 10000
+#define ITERATIONS 20
+#define DERIVE_ITERATIONS 3
+#define BENCH_FILE "bench_save.tox"
+
+static const char passphrase[] = "correct horse battery staple";
+
+static void report(const char *name, uint64_t total_us, size_t ops)
+{
+    printf("  %-28s %10.2f ms/save\n", name, total_us / 1000.0 / ops);
+}
+
+static Tox *make_profile(void)
+{
+    struct Tox_Options *options = tox_options_new(NULL);
+
+    if (options == NULL) {
+        return NULL;
+    }
+
+    tox_options_set_udp_enabled(options, false);
+    tox_options_set_local_discovery_enabled(options, false);
+
+    Tox *m = tox_new(options, NULL);
+    tox_options_free(options);
+
+    if (m == NULL) {
+        return NULL;
+    }
+
+    srand(1);
+
+    for (size_t i = 0; i < NUM_FRIENDS; ++i) {
+        uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+
+        for (size_t j = 0; j < TOX_PUBLIC_KEY_SIZE; ++j) {
+            public_key[j] = (uint8_t) rand();
+        }
+
+        public_key[TOX_PUBLIC_KEY_SIZE - 1] &= 0x7F;
+
+        tox_friend_add_norequest(m, public_key, NULL);
+    }
+
+    return m;
+}
+
+int main(void)
+{
+    Tox *m = make_profile();
+
+    if (m == NULL) {
+        fprintf(stderr, "Failed to create profile\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t length = tox_get_savedata_size(m);
+    uint8_t *data = malloc(length);
+    uint8_t *ciphertext = malloc(length + TOX_PASS_ENCRYPTION_EXTRA_LENGTH);
+
+    if (data == NULL || ciphertext == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    tox_get_savedata(m, data);
+
+    printf("profile: %zu friends, %zu bytes\n", tox_self_get_friend_list_size(m), length);
+
+    uint64_t start = get_monotonic_time();
+
+    for (size_t i = 0; i < ITERATIONS; ++i) {
+        save_file_atomic(BENCH_FILE, data, length);
+    }
+
+    report("plaintext", get_monotonic_time() - start, ITERATIONS);
+
+    start = get_monotonic_time();
+
+    if (saver_set_passphrase((const uint8_t *) passphrase, strlen(passphrase), NULL) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    report("key derivation (once)", get_monotonic_time() - start, 1);
+
+    start = get_monotonic_time();
+
+    for (size_t i = 0; i < ITERATIONS; ++i) {
+        save_profile_data(BENCH_FILE, data, length);
+    }
+
+    report("encrypted, cached key", get_monotonic_time() - start, ITERATIONS);
+
+    start = get_monotonic_time();
+
+    for (size_t i = 0; i < DERIVE_ITERATIONS; ++i) {
+        tox_pass_encrypt(data, length, (const uint8_t *) passphrase, strlen(passphrase), ciphertext, NULL);
+        save_file_atomic(BENCH_FILE, ciphertext, length + TOX_PASS_ENCRYPTION_EXTRA_LENGTH);
+    }
+
+    report("encrypted, key per save", get_monotonic_time() - start, DERIVE_ITERATIONS);
+
+    saver_shutdown();
+    free(ciphertext);
+    free(data);
+    tox_kill(m);
+    remove(BENCH_FILE);
+
+    return EXIT_SUCCESS;
+}
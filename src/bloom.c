@@ -0,0 +1,144 @@
+/*  bloom.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <tox/tox.h>
+
+#include "bloom.h"
+
+#define BLOOM_BLOCK_BITS (BLOOM_BLOCK_WORDS * 64)
+
+static uint64_t bloom_hash(const struct Bloom_Filter *filter, const uint8_t *public_key)
+{
+    uint64_t h = filter->seed;
+
+    for (size_t i = 0; i < TOX_PUBLIC_KEY_SIZE; i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, public_key + i, sizeof(w));
+        h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+    }
+
+    return h;
+}
+
+int bloom_init(struct Bloom_Filter *filter, size_t expected_keys, uint64_t seed)
+{
+    size_t num_bits = expected_keys * BLOOM_BITS_PER_KEY;
+    size_t num_blocks = (num_bits + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS;
+
+    if (num_blocks == 0) {
+        num_blocks = 1;
+    }
+
+    uint64_t *blocks = calloc(num_blocks * BLOOM_BLOCK_WORDS, sizeof(uint64_t));
+
+    if (blocks == NULL) {
+        return -1;
+    }
+
+    filter->blocks = blocks;
+    filter->num_blocks = num_blocks;
+    filter->num_keys = 0;
+    filter->seed = seed;
+
+    return 0;
+}
+
+void bloom_free(struct Bloom_Filter *filter)
+{
+    free(filter->blocks);
+    filter->blocks = NULL;
+    filter->num_blocks = 0;
+    filter->num_keys = 0;
+}
+
+void bloom_add(struct Bloom_Filter *filter, const uint8_t *public_key)
+{
+    uint64_t h = bloom_hash(filter, public_key);
+    uint64_t *block = &filter->blocks[(h % filter->num_blocks) * BLOOM_BLOCK_WORDS];
+    uint32_t h1 = (uint32_t) h;
+    uint32_t h2 = (uint32_t) (h >> 32) | 1;
+
+    for (size_t i = 0; i < BLOOM_NUM_HASHES; ++i) {
+        uint32_t bit = (h1 + i * h2) % BLOOM_BLOCK_BITS;
+        block[bit / 64] |= 1ULL << (bit % 64);
+    }
+
+    ++filter->num_keys;
+}
+
+bool bloom_contains(const struct Bloom_Filter *filter, const uint8_t *public_key)
+{
+    uint64_t h = bloom_hash(filter, public_key);
+    const uint64_t *block = &filter->blocks[(h % filter->num_blocks) * BLOOM_BLOCK_WORDS];
+    uint32_t h1 = (uint32_t) h;
+    uint32_t h2 = (uint32_t) (h >> 32) | 1;
+
+    for (size_t i = 0; i < BLOOM_NUM_HASHES; ++i) {
+        uint32_t bit = (h1 + i * h2) % BLOOM_BLOCK_BITS;
+
+        if (!(block[bit / 64] & (1ULL << (bit % 64)))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+size_t bloom_size(const struct Bloom_Filter *filter)
+{
+    return filter->num_blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t);
+}
+
+double bloom_false_positive_rate(const struct Bloom_Filter *filter)
+{
+    if (filter->num_blocks == 0) {
+        return 0.0;
+    }
+
+    double total = 0.0;
+
+    /* A lookup is a false positive when all of its bits happen to be set in the one block it maps to.
+     * Blocks fill unevenly, so the estimate is averaged per block rather than taken over the whole filter. */
+    for (size_t b = 0; b < filter->num_blocks; ++b) {
+        const uint64_t *block = &filter->blocks[b * BLOOM_BLOCK_WORDS];
+        size_t bits_set = 0;
+
+        for (size_t i = 0; i < BLOOM_BLOCK_WORDS; ++i) {
+            bits_set += __builtin_popcountll(block[i]);
+        }
+
+        double fill = (double) bits_set / BLOOM_BLOCK_BITS;
+        double rate = 1.0;
+
+        for (size_t i = 0; i < BLOOM_NUM_HASHES; ++i) {
+            rate *= fill;
+        }
+
+        total += rate;
+    }
+
+    return total / (double) filter->num_blocks;
+}
@@ -0,0 +1,71 @@
+/*  bloom.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Each block is one 64 byte cache line; all bits for a key are set within a single block */
+#define BLOOM_BLOCK_WORDS 8
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_NUM_HASHES 7
+
+/*
+ * A cache-blocked bloom filter of public keys. A lookup touches exactly one cache line.
+ */
+struct Bloom_Filter {
+    uint64_t *blocks;
+    size_t    num_blocks;
+    size_t    num_keys;
+    uint64_t  seed;
+};
+
+/*
+ * Initializes an empty filter sized for `expected_keys` keys.
+ *
+ * Returns 0 on success.
+ * Returns -1 on allocation failure.
+ */
+int bloom_init(struct Bloom_Filter *filter, size_t expected_keys, uint64_t seed);
+
+/* Frees all memory associated with `filter`. */
+void bloom_free(struct Bloom_Filter *filter);
+
+/* Adds `public_key` to `filter`. */
+void bloom_add(struct Bloom_Filter *filter, const uint8_t *public_key);
+
+/*
+ * Returns false if `public_key` is definitely not in `filter`.
+ * Returns true if `public_key` may be in `filter`.
+ */
+bool bloom_contains(const struct Bloom_Filter *filter, const uint8_t *public_key);
+
+/* Returns the size of `filter` in bytes. */
+size_t bloom_size(const struct Bloom_Filter *filter);
+
+/* Returns the estimated false positive rate of `filter` based on how many of its bits are set. */
+double bloom_false_positive_rate(const struct Bloom_Filter *filter);
+
+#endif /* BLOOM_H */
@@ -0,0 +1,200 @@
+/*  broadcast.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "broadcast.h"
+#include "friends.h"
+#include "log.h"
+#include "misc.h"
+#include "outbox.h"
+
+/* The most messages and bytes a broadcast sends per main loop iteration */
+#define BROADCAST_MESSAGE_BUDGET 64
+#define BROADCAST_BYTE_BUDGET (32 * 1024)
+
+/* The most recipients a broadcast looks at per main loop iteration, counting offline friends it skips */
+#define BROADCAST_SCAN_BUDGET 1024
+
+static struct Broadcast {
+    bool             active;
+    Broadcast_Target target;
+    uint8_t          requester_key[TOX_PUBLIC_KEY_SIZE];  // the master who started the broadcast
+
+    uint32_t *recipients;  // friendnumbers or groupnumbers
+    size_t    num_recipients;
+    size_t    next;  // index of the next recipient to send to
+
+    char     message[TOX_MAX_MESSAGE_LENGTH];
+    size_t   length;
+
+    uint64_t start_time;  // monotonic
+    size_t   num_sent;
+    size_t   num_skipped;  // offline friends
+    size_t   num_failed;
+} broadcast;
+
+int broadcast_start(Tox *m, Broadcast_Target target, uint32_t friendnumber, const char *message, size_t length)
+{
+    if (broadcast.active) {
+        return -1;
+    }
+
+    const uint8_t *requester_key = friend_get_public_key(m, friendnumber);
+
+    if (requester_key == NULL) {
+        return -1;
+    }
+
+    size_t count = target == BROADCAST_FRIENDS ? tox_self_get_friend_list_size(m) : tox_conference_get_chatlist_size(m);
+    uint32_t *recipients = malloc(MAX(count, 1) * sizeof(uint32_t));
+
+    if (recipients == NULL) {
+        return -1;
+    }
+
+    if (target == BROADCAST_FRIENDS) {
+        tox_self_get_friend_list(m, recipients);
+
+        /* the requester gets the completion report instead */
+        for (size_t i = 0; i < count; ++i) {
+            if (recipients[i] == friendnumber) {
+                recipients[i] = recipients[--count];
+                break;
+            }
+        }
+    } else {
+        tox_conference_get_chatlist(m, recipients);
+    }
+
+    length = MIN(length, sizeof(broadcast.message));
+
+    broadcast = (struct Broadcast) {
+        .active = true,
+        .target = target,
+        .recipients = recipients,
+        .num_recipients = count,
+        .length = length,
+        .start_time = get_monotonic_time(),
+    };
+
+    memcpy(broadcast.requester_key, requester_key, TOX_PUBLIC_KEY_SIZE);
+    memcpy(broadcast.message, message, length);
+
+    return count;
+}
+
+/*
+ * Sends the message to the recipient at `idx`.
+ *
+ * Returns 1 if it was sent, 0 if the recipient was skipped, and -1 if sending failed.
+ */
+static int send_to(Tox *m, size_t idx)
+{
+    uint32_t num = broadcast.recipients[idx];
+
+    if (broadcast.target == BROADCAST_FRIENDS) {
+        if (!friend_is_online(num)) {
+            return 0;
+        }
+
+        /* a full send queue is retried by the outbox */
+        return outbox_send(m, num, broadcast.message, broadcast.length) == 0 ? 1 : -1;
+    }
+
+    TOX_ERR_CONFERENCE_SEND_MESSAGE err;
+
+    if (!tox_conference_send_message(m, num, TOX_MESSAGE_TYPE_NORMAL, (const uint8_t *) broadcast.message,
+                                     broadcast.length, &err)) {
+        return -1;
+    }
+
+    return 1;
+}
+
+static void broadcast_finish(Tox *m)
+{
+    uint64_t elapsed = get_monotonic_time() - broadcast.start_time;
+    const char *type = broadcast.target == BROADCAST_FRIENDS ? "friends" : "groups";
+
+    char outmsg[TOX_MAX_MESSAGE_LENGTH];
+    snprintf(outmsg, sizeof(outmsg), "Broadcast to %s complete in %"PRIu64".%03"PRIu64" s: %zu sent, %zu offline, %zu failed",
+             type, elapsed / 1000000, elapsed / 1000 % 1000, broadcast.num_sent, broadcast.num_skipped, broadcast.num_failed);
+
+    log_timestamp("%s", outmsg);
+
+    /* the requester may have been deleted, or its friendnumber reused, since the broadcast started */
+    Tox_Err_Friend_By_Public_Key err;
+    uint32_t requester = tox_friend_by_public_key(m, broadcast.requester_key, &err);
+
+    if (err == TOX_ERR_FRIEND_BY_PUBLIC_KEY_OK) {
+        outbox_send(m, requester, outmsg, strlen(outmsg));
+    }
+
+    free(broadcast.recipients);
+    broadcast = (struct Broadcast) {
+        0
+    };
+}
+
+void broadcast_process(Tox *m)
+{
+    if (!broadcast.active) {
+        return;
+    }
+
+    size_t messages = 0;
+    size_t bytes = 0;
+    size_t scanned = 0;
+
+    while (broadcast.next < broadcast.num_recipients && messages < BROADCAST_MESSAGE_BUDGET
+            && bytes + broadcast.length <= BROADCAST_BYTE_BUDGET && scanned < BROADCAST_SCAN_BUDGET) {
+        int ret = send_to(m, broadcast.next++);
+        ++scanned;
+
+        if (ret == 0) {
+            ++broadcast.num_skipped;
+            continue;
+        }
+
+        if (ret == 1) {
+            ++broadcast.num_sent;
+        } else {
+            ++broadcast.num_failed;
+        }
+
+        ++messages;
+        bytes += broadcast.length;
+    }
+
+    if (broadcast.next == broadcast.num_recipients) {
+        broadcast_finish(m);
+    }
+}
+
+bool broadcast_active(void)
+{
+    return broadcast.active;
+}
@@ -0,0 +1,59 @@
+/*  broadcast.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BROADCAST_H
+#define BROADCAST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <tox/tox.h>
+
+/*
+ * Fan-out of a message to every online friend or every group.
+ *
+ * The recipients are listed when the broadcast starts and sent to from the main loop a slice at a
+ * time, within a per-iteration budget of messages and bytes, so that a broadcast to thousands of
+ * recipients never stalls tox_iterate(). Only one broadcast runs at a time.
+ */
+
+typedef enum Broadcast_Target {
+    BROADCAST_FRIENDS,
+    BROADCAST_GROUPS,
+} Broadcast_Target;
+
+/*
+ * Starts sending `message` to every recipient of type `target`. friendnumber is left out of a friend
+ * broadcast and is told when the broadcast completes, if it's still a friend by then.
+ *
+ * Returns the number of recipients.
+ * Returns -1 if a broadcast is already running or on allocation failure.
+ */
+int broadcast_start(Tox *m, Broadcast_Target target, uint32_t friendnumber, const char *message, size_t length);
+
+/* Sends the next slice of the running broadcast, if any. This should be called once per main loop iteration. */
+void broadcast_process(Tox *m);
+
+/* Returns true if a broadcast is running. */
+bool broadcast_active(void);
+
+#endif /* BROADCAST_H */
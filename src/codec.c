@@ -0,0 +1,235 @@
+/*  codec.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "codec.h"
+
+static const char hex_chars[16] = "0123456789ABCDEF";
+
+/* Maps each char to its hex digit value, or -1 if it's not a hex digit */
+static const int8_t hex_values[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+static void encode_scalar(char *hex, const uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; ++i) {
+        hex[i * 2] = hex_chars[data[i] >> 4];
+        hex[i * 2 + 1] = hex_chars[data[i] & 0x0F];
+    }
+}
+
+static int decode_scalar(uint8_t *data, size_t length, const char *hex)
+{
+    int8_t bad = 0;
+
+    for (size_t i = 0; i < length; ++i) {
+        int8_t hi = hex_values[(uint8_t) hex[i * 2]];
+        int8_t lo = hex_values[(uint8_t) hex[i * 2 + 1]];
+        bad |= hi | lo;
+        data[i] = (uint8_t) ((hi << 4) | (lo & 0x0F));
+    }
+
+    return bad < 0 ? -1 : 0;
+}
+
+#if defined(__SSE2__)
+
+/* Converts 16 nibbles (one per byte) to their uppercase hex chars */
+static __m128i nibbles_to_hex_128(__m128i nibbles)
+{
+    __m128i letters = _mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9));
+    __m128i chars = _mm_add_epi8(nibbles, _mm_set1_epi8('0'));
+    return _mm_add_epi8(chars, _mm_and_si128(letters, _mm_set1_epi8('A' - '0' - 10)));
+}
+
+/*
+ * Converts 16 hex chars to their values. Lanes that are not hex digits are cleared in `valid`.
+ * The unsigned range checks are done as signed compares after flipping the sign bit.
+ */
+static __m128i hex_to_nibbles_128(__m128i chars, __m128i *valid)
+{
+    const __m128i bias = _mm_set1_epi8((char) 0x80);
+
+    __m128i digits = _mm_sub_epi8(chars, _mm_set1_epi8('0'));
+    __m128i is_digit = _mm_cmplt_epi8(_mm_xor_si128(digits, bias), _mm_set1_epi8((char) (10 ^ 0x80)));
+
+    __m128i letters = _mm_sub_epi8(_mm_or_si128(chars, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i is_letter = _mm_cmplt_epi8(_mm_xor_si128(letters, bias), _mm_set1_epi8((char) (6 ^ 0x80)));
+
+    *valid = _mm_and_si128(*valid, _mm_or_si128(is_digit, is_letter));
+
+    return _mm_or_si128(_mm_and_si128(is_digit, digits),
+                        _mm_and_si128(is_letter, _mm_add_epi8(letters, _mm_set1_epi8(10))));
+}
+
+/* Packs 16 nibbles, high nibble first, into 8 bytes held in the low byte of each 16-bit lane */
+static __m128i pack_nibble_pairs_128(__m128i nibbles)
+{
+    __m128i pairs = _mm_or_si128(_mm_slli_epi16(nibbles, 4), _mm_srli_epi16(nibbles, 8));
+    return _mm_and_si128(pairs, _mm_set1_epi16(0x00FF));
+}
+
+#endif /* __SSE2__ */
+
+#if defined(__AVX2__)
+
+static __m256i nibbles_to_hex_256(__m256i nibbles)
+{
+    __m256i letters = _mm256_cmpgt_epi8(nibbles, _mm256_set1_epi8(9));
+    __m256i chars = _mm256_add_epi8(nibbles, _mm256_set1_epi8('0'));
+    return _mm256_add_epi8(chars, _mm256_and_si256(letters, _mm256_set1_epi8('A' - '0' - 10)));
+}
+
+static __m256i hex_to_nibbles_256(__m256i chars, __m256i *valid)
+{
+    __m256i digits = _mm256_sub_epi8(chars, _mm256_set1_epi8('0'));
+    __m256i is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(digits, _mm256_set1_epi8(9)), digits);
+
+    __m256i letters = _mm256_sub_epi8(_mm256_or_si256(chars, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+    __m256i is_letter = _mm256_cmpeq_epi8(_mm256_min_epu8(letters, _mm256_set1_epi8(5)), letters);
+
+    *valid = _mm256_and_si256(*valid, _mm256_or_si256(is_digit, is_letter));
+
+    return _mm256_or_si256(_mm256_and_si256(is_digit, digits),
+                           _mm256_and_si256(is_letter, _mm256_add_epi8(letters, _mm256_set1_epi8(10))));
+}
+
+static __m256i pack_nibble_pairs_256(__m256i nibbles)
+{
+    __m256i pairs = _mm256_or_si256(_mm256_slli_epi16(nibbles, 4), _mm256_srli_epi16(nibbles, 8));
+    return _mm256_and_si256(pairs, _mm256_set1_epi16(0x00FF));
+}
+
+#endif /* __AVX2__ */
+
+void hex_encode(char *hex, const uint8_t *data, size_t length)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *) &data[i]);
+        __m256i hi = nibbles_to_hex_256(_mm256_and_si256(_mm256_srli_epi16(bytes, 4), _mm256_set1_epi8(0x0F)));
+        __m256i lo = nibbles_to_hex_256(_mm256_and_si256(bytes, _mm256_set1_epi8(0x0F)));
+
+        /* unpack works within 128-bit lanes, so the halves come out as bytes 0-7/16-23 and 8-15/24-31 */
+        __m256i a = _mm256_unpacklo_epi8(hi, lo);
+        __m256i b = _mm256_unpackhi_epi8(hi, lo);
+
+        _mm256_storeu_si256((__m256i *) &hex[i * 2], _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i *) &hex[i * 2 + 32], _mm256_permute2x128_si256(a, b, 0x31));
+    }
+
+#endif
+
+#if defined(__SSE2__)
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *) &data[i]);
+        __m128i hi = nibbles_to_hex_128(_mm_and_si128(_mm_srli_epi16(bytes, 4), _mm_set1_epi8(0x0F)));
+        __m128i lo = nibbles_to_hex_128(_mm_and_si128(bytes, _mm_set1_epi8(0x0F)));
+
+        _mm_storeu_si128((__m128i *) &hex[i * 2], _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *) &hex[i * 2 + 16], _mm_unpackhi_epi8(hi, lo));
+    }
+
+#endif
+
+    encode_scalar(&hex[i * 2], &data[i], length - i);
+    hex[length * 2] = '\0';
+}
+
+int hex_decode(uint8_t *data, size_t length, const char *hex)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+
+    __m256i valid256 = _mm256_set1_epi8(-1);
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i a = hex_to_nibbles_256(_mm256_loadu_si256((const __m256i *) &hex[i * 2]), &valid256);
+        __m256i b = hex_to_nibbles_256(_mm256_loadu_si256((const __m256i *) &hex[i * 2 + 32]), &valid256);
+
+        /* packus interleaves the 128-bit lanes of its inputs; the permute puts them back in order */
+        __m256i packed = _mm256_packus_epi16(pack_nibble_pairs_256(a), pack_nibble_pairs_256(b));
+        _mm256_storeu_si256((__m256i *) &data[i], _mm256_permute4x64_epi64(packed, 0xD8));
+    }
+
+    if (_mm256_movemask_epi8(valid256) != -1) {
+        return -1;
+    }
+
+#endif
+
+#if defined(__SSE2__)
+
+    __m128i valid128 = _mm_set1_epi8(-1);
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i a = hex_to_nibbles_128(_mm_loadu_si128((const __m128i *) &hex[i * 2]), &valid128);
+        __m128i b = hex_to_nibbles_128(_mm_loadu_si128((const __m128i *) &hex[i * 2 + 16]), &valid128);
+
+        _mm_storeu_si128((__m128i *) &data[i], _mm_packus_epi16(pack_nibble_pairs_128(a), pack_nibble_pairs_128(b)));
+    }
+
+    if (_mm_movemask_epi8(valid128) != 0xFFFF) {
+        return -1;
+    }
+
+#endif
+
+    return decode_scalar(&data[i], length - i, &hex[i * 2]);
+}
+
+const char *hex_codec_name(void)
+{
+#if defined(__AVX2__)
+    return "avx2";
+#elif defined(__SSE2__)
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
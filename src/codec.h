@@ -0,0 +1,54 @@
+/*  codec.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hex codec for Tox keys and addresses.
+ *
+ * Uses AVX2 or SSE2 when the compiler targets them (e.g. CFLAGS=-mavx2) and falls back to
+ * table lookups otherwise.
+ */
+
+/*
+ * Encodes `length` bytes of `data` as uppercase hex into `hex`, which must have room for
+ * `length` * 2 + 1 chars. The output is null terminated.
+ */
+void hex_encode(char *hex, const uint8_t *data, size_t length);
+
+/*
+ * Decodes the first `length` * 2 chars of `hex` into `data`. Either case is accepted. Note that all of
+ * those chars are read regardless of where the string ends, so the caller must check its length.
+ *
+ * Returns 0 on success.
+ * Returns -1 if any of those chars is not a hex digit, in which case the contents of `data` are unspecified.
+ */
+int hex_decode(uint8_t *data, size_t length, const char *hex);
+
+/* Returns the name of the implementation hex_encode() and hex_decode() were compiled with. */
+const char *hex_codec_name(void);
+
+#endif /* CODEC_H */
@@ -29,11 +29,21 @@
 #include <tox/toxav.h>
 
 #include "toxbot.h"
+#include "friends.h"
 #include "misc.h"
+#include "broadcast.h"
+#include "codec.h"
 #include "groupchats.h"
 #include "log.h"
+#include "outbox.h"
+#include "overload.h"
+#include "requests.h"
+#include "response.h"
+#include "saver.h"
+#include "tokenizer.h"
 
 #define MAX_COMMAND_LENGTH TOX_MAX_MESSAGE_LENGTH
+/* One more token than any command takes, so that surplus arguments are caught */
 #define MAX_NUM_ARGS 4
 
 extern struct Tox_Bot Tox_Bot;
@@ -41,36 +51,25 @@ extern struct Tox_Bot Tox_Bot;
 static void authent_failed(Tox *m, uint32_t friendnum)
 {
     const char *outmsg = "You do not have permission to use this command.";
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    outbox_send(m, friendnum, outmsg, strlen(outmsg));
 }
 
 static void send_error(Tox *m, uint32_t friendnum, const char *message, int err)
 {
     char outmsg[TOX_MAX_MESSAGE_LENGTH];
     snprintf(outmsg, sizeof(outmsg), "%s (error %d)", message, err);
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    outbox_send(m, friendnum, outmsg, strlen(outmsg));
 }
 
-static void cmd_default(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_default(Tox *m, uint32_t friendnum, int argc, char **argv, const struct Token *tokens)
 {
     const char *outmsg = NULL;
 
-    if (!friend_is_master(m, friendnum)) {
-        authent_failed(m, friendnum);
-        return;
-    }
-
-    if (argc < 1) {
-        outmsg = "Error: Room number required";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
-        return;
-    }
-
     int groupnum = atoi(argv[1]);
 
     if ((groupnum == 0 && strcmp(argv[1], "0")) || groupnum < 0) {
         outmsg = "Error: Invalid room number";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
@@ -78,97 +77,107 @@ static void cmd_default(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_C
 
     char msg[MAX_COMMAND_LENGTH];
     snprintf(msg, sizeof(msg), "Default room number set to %d", groupnum);
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) msg, strlen(msg), NULL);
+    outbox_send(m, friendnum, msg, strlen(msg));
 
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t len = tox_friend_get_name_size(m, friendnum, NULL);
-    name[len] = '\0';
+    const char *name = friend_get_name(m, friendnum);
 
     log_timestamp("Default room number set to %d by %s", groupnum, name);
+    request_groups_save();
 }
 
-static void cmd_gmessage(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_gmessage(Tox *m, uint32_t friendnum, int argc, char **argv, const struct Token *tokens)
 {
     const char *outmsg = NULL;
 
-    if (!friend_is_master(m, friendnum)) {
-        authent_failed(m, friendnum);
-        return;
-    }
-
-    if (argc < 1) {
-        outmsg = "Error: Group number required";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
-        return;
-    }
-
-    if (argc < 2) {
-        outmsg = "Error: Message required";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
-        return;
-    }
-
     int groupnum = atoi(argv[1]);
 
     if (groupnum == 0 && strcmp(argv[1], "0")) {
         outmsg = "Error: Invalid group number";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
-    if (group_index(groupnum) == -1) {
+    if (group_get(groupnum) == NULL) {
         outmsg = "Error: Invalid group number";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
-    if (argv[2][0] != '\"') {
+    if (!tokens[2].quoted) {
         outmsg = "Error: Message must be enclosed in quotes";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
-    /* remove opening and closing quotes */
-    char msg[MAX_COMMAND_LENGTH];
-    snprintf(msg, sizeof(msg), "%s", &argv[2][1]);
-    int len = strlen(msg) - 1;
-    msg[len] = '\0';
+    const char *msg = argv[2];
 
     TOX_ERR_CONFERENCE_SEND_MESSAGE err;
 
-    if (!tox_conference_send_message(m, groupnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) msg, strlen(msg), &err)) {
+    if (!tox_conference_send_message(m, groupnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) msg, tokens[2].length, &err)) {
         outmsg = "Error: Failed to send message.";
         send_error(m, friendnum, outmsg, err);
         return;
     }
 
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t nlen = tox_friend_get_name_size(m, friendnum, NULL);
-    name[nlen] = '\0';
+    const char *name = friend_get_name(m, friendnum);
 
     outmsg = "Message sent.";
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    outbox_send(m, friendnum, outmsg, strlen(outmsg));
     log_timestamp("<%s> message to group %d: %s", name, groupnum, msg);
 }
 
-static void cmd_group(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void start_broadcast(Tox *m, uint32_t friendnum, Broadcast_Target target, char **argv,
+                            const struct Token *tokens)
 {
     const char *outmsg = NULL;
 
-    if (argc < 1) {
-        outmsg = "Please specify the group type: audio or text";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    if (!tokens[1].quoted) {
+        outmsg = "Error: Message must be enclosed in quotes";
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
+    if (broadcast_active()) {
+        outmsg = "Error: A broadcast is already in progress";
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    int count = broadcast_start(m, target, friendnum, argv[1], tokens[1].length);
+
+    if (count == -1) {
+        outmsg = "Error: Failed to start broadcast";
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    const char *type = target == BROADCAST_FRIENDS ? "friends" : "groups";
+    const char *name = friend_get_name(m, friendnum);
+
+    char msg[MAX_COMMAND_LENGTH];
+    snprintf(msg, sizeof(msg), "Broadcasting to %d %s", count, type);
+    outbox_send(m, friendnum, msg, strlen(msg));
+
+    log_timestamp("<%s> broadcast to %d %s: %s", name, count, type, argv[1]);
+}
+
+static void cmd_broadcast(Tox *m, uint32_t friendnum, int argc, char **argv, const struct Token *tokens)
+{
+    start_broadcast(m, friendnum, BROADCAST_FRIENDS, argv, tokens);
+}
+
+static void cmd_gbroadcast(Tox *m, uint32_t friendnum, int argc, char **argv, const struct Token *tokens)
+{
+    start_broadcast(m, friendnum, BROADCAST_GROUPS, argv, tokens);
+}
+
+static void cmd_group(Tox *m, uint32_t friendnum, int argc, char **argv, const struct Token *tokens)
+{
+    const char *outmsg = NULL;
+
     uint8_t type = TOX_CONFERENCE_TYPE_AV ? !strcasecmp(argv[1], "audio") : TOX_CONFERENCE_TYPE_TEXT;
 
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t len = tox_friend_get_name_size(m, friendnum, NULL);
-    name[len] = '\0';
+    const char *name = friend_get_name(m, friendnum);
 
     int groupnum = -1;
 
@@ -179,7 +188,7 @@ static void cmd_group(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COM
         if (err != TOX_ERR_CONFERENCE_NEW_OK) {
             log_error_timestamp(err, "Group chat creation by %s failed to initialize", name);
             outmsg = "Group chat instance failed to initialize.";
-            tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+            outbox_send(m, friendnum, outmsg, strlen(outmsg));
             return;
         }
     } else if (type == TOX_CONFERENCE_TYPE_AV) {
@@ -188,7 +197,7 @@ static void cmd_group(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COM
         if (groupnum == -1) {
             log_error_timestamp(-1, "Group chat creation by %s failed to initialize", name);
             outmsg = "Group chat instance failed to initialize.";
-            tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+            outbox_send(m, friendnum, outmsg, strlen(outmsg));
             return;
         }
     }
@@ -198,116 +207,152 @@ static void cmd_group(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COM
     if (password && strlen(argv[2]) >= MAX_PASSWORD_SIZE) {
         log_error_timestamp(-1, "Group chat creation by %s failed: Password too long", name);
         outmsg = "Group chat instance failed to initialize: Password too long";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
     if (group_add(groupnum, type, password) == -1) {
         log_error_timestamp(-1, "Group chat creation by %s failed", name);
         outmsg = "Group chat creation failed";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         tox_conference_delete(m, groupnum, NULL);
         return;
     }
 
     const char *pw = password ? " (Password protected)" : "";
     log_timestamp("Group chat %d created by %s%s", groupnum, name, pw);
+    request_groups_save();
 
     char msg[MAX_COMMAND_LENGTH];
     snprintf(msg, sizeof(msg), "Group chat %d created%s", groupnum, pw);
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) msg, strlen(msg), NULL);
+    outbox_send(m, friendnum, msg, strlen(msg));
 }
 
-static void cmd_help(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
-{
-    const char *outmsg = NULL;
+/* The help reply is the same for every friend of a given role, so it's built at compile time */
+#define HELP_REPLY \
+    "info : Print my current status and list active group chats\n" \
+    "id : Print my Tox ID\n" \
+    "version : Print my version\n" \
+    "invite : Request invite to default group chat\n" \
+    "invite <n> <p> : Request invite to group chat n (with password p if protected)\n" \
+    "group <type> <pass> : Creates a new groupchat with type: text | audio (optional password)"
 
-    outmsg = "info : Print my current status and list active group chats";
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+static const char help_reply[] = HELP_REPLY;
+static const char help_reply_master[] = HELP_REPLY "\nFor a list of master commands see the commands.txt file";
 
-    outmsg = "id : Print my Tox ID";
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
-
-    outmsg = "invite : Request invite to default group chat";
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+/* Replies that depend only on our own profile, built when it changes rather than per request */
+static struct {
+    char     id[TOX_ADDRESS_SIZE * 2 + 1];
+    uint32_t id_nospam;  // the nospam value `id` was built with
+    char     version[64];
+    size_t   version_length;
+} replies;
 
-    outmsg = "invite <n> <p> : Request invite to group chat n (with password p if protected)";
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+static void build_id_reply(Tox *m)
+{
+    uint8_t address[TOX_ADDRESS_SIZE];
+    tox_self_get_address(m, address);
 
-    outmsg = "group <type> <pass> : Creates a new groupchat with type: text | audio (optional password)";
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    hex_encode(replies.id, address, TOX_ADDRESS_SIZE);
+    replies.id_nospam = tox_self_get_nospam(m);
+}
 
+static void cmd_help(Tox *m, uint32_t friendnum, int argc, char **argv, const struct Token *tokens)
+{
     if (friend_is_master(m, friendnum)) {
-        outmsg = "For a list of master commands see the commands.txt file";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        outbox_send(m, friendnum, help_reply_master, sizeof(help_reply_master) - 1);
+    } else {
+        outbox_send(m, friendnum, help_reply, sizeof(help_reply) - 1);
     }
 }
 
-static void cmd_id(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_id(Tox *m, uint32_t friendnum, int argc, char **argv, const struct Token *tokens)
 {
-    char outmsg[TOX_ADDRESS_SIZE * 2 + 1];
-    char address[TOX_ADDRESS_SIZE];
-    tox_self_get_address(m, (uint8_t *) address);
-
-    for (size_t i = 0; i < TOX_ADDRESS_SIZE; ++i) {
-        char d[3];
-        sprintf(d, "%02X", address[i] & 0xff);
-        memcpy(outmsg + i * 2, d, 2);
+    /* the address only changes along with the nospam value */
+    if (tox_self_get_nospam(m) != replies.id_nospam) {
+        build_id_reply(m);
     }
 
-    outmsg[TOX_ADDRESS_SIZE * 2] = '\0';
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    outbox_send(m, friendnum, replies.id, TOX_ADDRESS_SIZE * 2);
 }
 
-static void cmd_info(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_version(Tox *m, uint32_t friendnum, int argc, char **argv, const struct Token *tokens)
 {
-    char outmsg[MAX_COMMAND_LENGTH];
+    outbox_send(m, friendnum, replies.version, replies.version_length);
+}
+
+static void cmd_info(Tox *m, uint32_t friendnum, int argc, char **argv, const struct Token *tokens)
+{
+    struct Response resp;
+    response_init(&resp, m, friendnum);
+
     char timestr[64];
 
     time_t curtime = get_time();
     get_elapsed_time_str(timestr, sizeof(timestr), curtime - Tox_Bot.start_time);
-    snprintf(outmsg, sizeof(outmsg), "Uptime: %s", timestr);
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    response_printf(&resp, "Uptime: %s", timestr);
 
     uint32_t numfriends = tox_self_get_friend_list_size(m);
-    snprintf(outmsg, sizeof(outmsg), "Friends: %d (%d online)", numfriends, Tox_Bot.num_online_friends);
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
 
-    snprintf(outmsg, sizeof(outmsg), "Inactive friends are purged after %"PRIu64" days",
-             Tox_Bot.inactive_limit / SECONDS_IN_DAY);
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    if (Tox_Bot.max_friends > 0) {
+        response_printf(&resp, "Friends: %d (%d online, max %"PRIu32")", numfriends, Tox_Bot.num_online_friends,
+                        Tox_Bot.max_friends);
+    } else {
+        response_printf(&resp, "Friends: %d (%d online)", numfriends, Tox_Bot.num_online_friends);
+    }
+
+    response_printf(&resp, "Inactive friends are purged after %"PRIu64" days", Tox_Bot.inactive_limit / SECONDS_IN_DAY);
 
-    /* List active group chats and number of peers in each */
-    size_t num_chats = tox_conference_get_chatlist_size(m);
+    response_printf(&resp, "Data file saves: %"PRIu64" requested, %"PRIu64" written", Tox_Bot.saves_requested,
+                    saver_num_writes());
+
+    const struct Request_Stats *req_stats = requests_get_stats();
+    response_printf(&resp, "Friend requests: %"PRIu64" accepted, %"PRIu64" deferred, %"PRIu64" dropped, %zu pending, %"PRIu64" evictions",
+                    req_stats->accepted, req_stats->deferred, req_stats->dropped, requests_pending(), req_stats->evicted);
 
-    if (num_chats == 0) {
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) "No active groupchats",
-                                strlen("No active groupchats"), NULL);
+    const struct Outbox_Stats *out_stats = outbox_get_stats();
+    response_printf(&resp, "Outbound messages: %"PRIu64" sent, %"PRIu64" deferred, %"PRIu64" dropped, %zu queued (peak %zu)",
+                    out_stats->sent, out_stats->deferred, out_stats->dropped, outbox_pending(), out_stats->peak);
+
+    const struct Overload_Stats *load_stats = overload_get_stats();
+    response_printf(&resp, "Load: tox_iterate() %"PRIu64".%03"PRIu64" ms avg, %s shedding commands (%"PRIu64" shed, %"PRIu64" rate limited)",
+                    overload_iterate_time() / 1000, overload_iterate_time() % 1000, overload_is_shedding() ? "now" : "not",
+                    load_stats->shed, load_stats->rate_limited);
+
+    const struct Bloom_Filter *filter = &Tox_Bot.blocked_keys.filter;
+    response_printf(&resp, "Blocked keys: %zu (filter: %zu KiB, %.4f%% false positive rate)",
+                    key_list_count(&Tox_Bot.blocked_keys), bloom_size(filter) / 1024, bloom_false_positive_rate(filter) * 100.0);
+
+    /* List active group chats and number of peers in each */
+    if (groups_count() == 0) {
+        response_printf(&resp, "No active groupchats");
+        response_flush(&resp);
         return;
     }
 
-    uint32_t groupchat_list[num_chats];
+    for (uint32_t i = 0; i < groups_num_slots(); ++i) {
+        const struct Group_Chat *chat = group_at(i);
 
-    tox_conference_get_chatlist(m, groupchat_list);
+        if (chat == NULL) {
+            continue;
+        }
 
-    for (size_t i = 0; i < num_chats; ++i) {
-        TOX_ERR_CONFERENCE_PEER_QUERY err;
-        uint32_t groupnum = groupchat_list[i];
-        uint32_t num_peers = tox_conference_peer_count(m, groupnum, &err);
+        size_t title_len = 0;
+        const char *title = group_get_title(chat->groupnum, &title_len);
 
-        if (err == TOX_ERR_CONFERENCE_PEER_QUERY_OK) {
-            int idx = group_index(groupnum);
-            const char *title = Tox_Bot.g_chats[idx].title_len
-                                ? Tox_Bot.g_chats[idx].title : "None";
-            const char *type = tox_conference_get_type(m, groupnum, NULL) == TOX_CONFERENCE_TYPE_AV ? "Audio" : "Text";
-            snprintf(outmsg, sizeof(outmsg), "Group %d | %s | peers: %d | Title: %s", groupnum, type,
-                     num_peers, title);
-            tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        if (title_len == 0) {
+            title = "None";
         }
+
+        const char *type = chat->type == TOX_CONFERENCE_TYPE_AV ? "Audio" : "Text";
+        response_printf(&resp, "Group %"PRIu32" | %s | peers: %"PRIu32" | Title: %s", chat->groupnum, type,
+                        chat->num_peers, title);
     }
+
+    response_flush(&resp);
 }
 
-static void cmd_invite(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_invite(Tox *m, uint32_t friendnum, int argc, char **argv, const struct Token *tokens)
 {
     const char *outmsg = NULL;
     int groupnum = Tox_Bot.default_groupnum;
@@ -317,25 +362,18 @@ static void cmd_invite(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_CO
 
         if (groupnum == 0 && strcmp(argv[1], "0")) {
             outmsg = "Error: Invalid group number";
-            tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+            outbox_send(m, friendnum, outmsg, strlen(outmsg));
             return;
         }
     }
 
-    int idx = group_index(groupnum);
-
-    if (idx == -1) {
+    if (group_get(groupnum) == NULL) {
         outmsg = "Group doesn't exist.";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
-    int has_pass = Tox_Bot.g_chats[idx].has_pass;
-
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t len = tox_friend_get_name_size(m, friendnum, NULL);
-    name[len] = '\0';
+    const char *name = friend_get_name(m, friendnum);
 
     const char *passwd = NULL;
 
@@ -343,10 +381,10 @@ static void cmd_invite(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_CO
         passwd = argv[2];
     }
 
-    if (has_pass && (!passwd || strcmp(argv[2], Tox_Bot.g_chats[idx].password) != 0)) {
+    if (!group_check_password(groupnum, passwd)) {
         log_error_timestamp(-1, "Failed to invite %s to group %d (invalid password)", name, groupnum);
         outmsg = "Invalid password.";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
@@ -362,247 +400,226 @@ static void cmd_invite(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_CO
     log_timestamp("Invited %s to group %d", name, groupnum);
 }
 
-static void cmd_leave(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_leave(Tox *m, uint32_t friendnum, int argc, char **argv, const struct Token *tokens)
 {
     const char *outmsg = NULL;
 
-    if (!friend_is_master(m, friendnum)) {
-        authent_failed(m, friendnum);
-        return;
-    }
-
-    if (argc < 1) {
-        outmsg = "Error: Group number required";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
-        return;
-    }
-
     int groupnum = atoi(argv[1]);
 
     if (groupnum == 0 && strcmp(argv[1], "0")) {
         outmsg = "Error: Invalid group number";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
     if (!tox_conference_delete(m, groupnum, NULL)) {
         outmsg = "Error: Invalid group number";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
     char msg[MAX_COMMAND_LENGTH];
 
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t len = tox_friend_get_name_size(m, friendnum, NULL);
-    name[len] = '\0';
+    const char *name = friend_get_name(m, friendnum);
 
     group_leave(groupnum);
+    request_groups_save();
 
     log_timestamp("Left group %d (%s)", groupnum, name);
     snprintf(msg, sizeof(msg), "Left group %d", groupnum);
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) msg, strlen(msg), NULL);
+    outbox_send(m, friendnum, msg, strlen(msg));
 }
 
-static void cmd_master(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+/* Decodes a Tox ID or public key given as a command argument. Returns false if it's malformed. */
+static bool parse_key_arg(const char *arg, uint8_t *public_key)
+{
+    size_t len = strlen(arg);
+
+    if (len != TOX_ADDRESS_SIZE * 2 && len != TOX_PUBLIC_KEY_SIZE * 2) {
+        return false;
+    }
+
+    return hex_decode(public_key, TOX_PUBLIC_KEY_SIZE, arg) == 0;
+}
+
+static void cmd_block(Tox *m, uint32_t friendnum, int argc, char **argv, const struct Token *tokens)
 {
     const char *outmsg = NULL;
 
-    if (!friend_is_master(m, friendnum)) {
-        authent_failed(m, friendnum);
+    const char *id = argv[1];
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+
+    if (!parse_key_arg(id, public_key)) {
+        outmsg = "Error: Invalid Tox ID";
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
-    if (argc < 1) {
-        outmsg = "Error: Tox ID required";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    if (key_list_contains(&Tox_Bot.master_keys, public_key)) {
+        outmsg = "Error: Masters can't be blocked";
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
-    const char *id = argv[1];
+    int ret = key_list_add(&Tox_Bot.blocked_keys, public_key);
 
-    if (strlen(id) != TOX_ADDRESS_SIZE * 2) {
-        outmsg = "Error: Invalid Tox ID";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    if (ret == -1) {
+        outmsg = "Error: Failed to update blocklist";
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
-    FILE *fp = fopen(MASTERLIST_FILE, "a");
-
-    if (fp == NULL) {
-        outmsg = "Error: could not find masterkeys file";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    if (ret == 0) {
+        outmsg = "ID is already blocked";
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
-    fprintf(fp, "%s\n", id);
-    fclose(fp);
+    Tox_Err_Friend_By_Public_Key err;
+    uint32_t blocked_friendnum = tox_friend_by_public_key(m, public_key, &err);
 
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t len = tox_friend_get_name_size(m, friendnum, NULL);
-    name[len] = '\0';
+    friends_invalidate_roles();
 
-    log_timestamp("%s added master: %s", name, id);
-    outmsg = "ID added to masterkeys list";
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    if (err == TOX_ERR_FRIEND_BY_PUBLIC_KEY_OK) {
+        tox_friend_delete(m, blocked_friendnum, NULL);
+        friend_reset(blocked_friendnum);
+        request_save();
+    }
+
+    const char *name = friend_get_name(m, friendnum);
+
+    log_timestamp("%s blocked: %s", name, id);
+    outmsg = "ID added to blocklist";
+    outbox_send(m, friendnum, outmsg, strlen(outmsg));
 }
 
-static void cmd_name(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_master(Tox *m, uint32_t friendnum, int argc, char **argv, const struct Token *tokens)
 {
     const char *outmsg = NULL;
 
-    if (!friend_is_master(m, friendnum)) {
-        authent_failed(m, friendnum);
+    const char *id = argv[1];
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+
+    if (!parse_key_arg(id, public_key)) {
+        outmsg = "Error: Invalid Tox ID";
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
-    if (argc < 1) {
-        outmsg = "Error: Name required";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    int ret = key_list_add(&Tox_Bot.master_keys, public_key);
+
+    if (ret == -1) {
+        outmsg = "Error: Failed to update masterkeys list";
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
-    char name[TOX_MAX_NAME_LENGTH];
-    int len = 0;
-
-    if (argv[1][0] == '\"') {    /* remove opening and closing quotes */
-        snprintf(name, sizeof(name), "%s", &argv[1][1]);
-        len = strlen(name) - 1;
-    } else {
-        snprintf(name, sizeof(name), "%s", argv[1]);
-        len = strlen(name);
+    if (ret == 0) {
+        outmsg = "ID is already in the masterkeys list";
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
+        return;
     }
 
+    friends_invalidate_roles();
+
+    const char *name = friend_get_name(m, friendnum);
+
+    log_timestamp("%s added master: %s", name, id);
+    outmsg = "ID added to masterkeys list";
+    outbox_send(m, friendnum, outmsg, strlen(outmsg));
+}
+
+static void cmd_name(Tox *m, uint32_t friendnum, int argc, char **argv, const struct Token *tokens)
+{
+    char name[TOX_MAX_NAME_LENGTH];
+    int len = MIN(tokens[1].length, sizeof(name) - 1);
+
+    memcpy(name, argv[1], len);
     name[len] = '\0';
     tox_self_set_name(m, (uint8_t *) name, (uint16_t) len, NULL);
 
-    char m_name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) m_name, NULL);
-    size_t nlen = tox_friend_get_name_size(m, friendnum, NULL);
-    m_name[nlen] = '\0';
+    const char *m_name = friend_get_name(m, friendnum);
 
     log_timestamp("%s set name to %s", m_name, name);
-    save_data(m, DATA_FILE);
+    request_save();
 }
 
-static void cmd_passwd(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_passwd(Tox *m, uint32_t friendnum, int argc, char **argv, const struct Token *tokens)
 {
     const char *outmsg = NULL;
 
-    if (!friend_is_master(m, friendnum)) {
-        authent_failed(m, friendnum);
-        return;
-    }
-
-    if (argc < 1) {
-        outmsg = "Error: group number required";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
-        return;
-    }
-
     int groupnum = atoi(argv[1]);
 
     if (groupnum == 0 && strcmp(argv[1], "0")) {
         outmsg = "Error: Invalid group number";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
-    int idx = group_index(groupnum);
-
-    if (idx == -1) {
+    if (group_get(groupnum) == NULL) {
         outmsg = "Error: Invalid group number";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t nlen = tox_friend_get_name_size(m, friendnum, NULL);
-    name[nlen] = '\0';
+    const char *name = friend_get_name(m, friendnum);
 
 
     /* no password */
     if (argc < 2) {
-        Tox_Bot.g_chats[idx].has_pass = false;
-        memset(Tox_Bot.g_chats[idx].password, 0, MAX_PASSWORD_SIZE);
+        group_set_password(groupnum, NULL);
+        request_groups_save();
 
         outmsg = "No password set";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         log_timestamp("No password set for group %d by %s", groupnum, name);
         return;
     }
 
     if (strlen(argv[2]) >= MAX_PASSWORD_SIZE) {
         outmsg = "Password too long";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
-    Tox_Bot.g_chats[idx].has_pass = true;
-    snprintf(Tox_Bot.g_chats[idx].password, sizeof(Tox_Bot.g_chats[idx].password), "%s", argv[2]);
+    group_set_password(groupnum, argv[2]);
+    request_groups_save();
 
     outmsg = "Password set";
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    outbox_send(m, friendnum, outmsg, strlen(outmsg));
     log_timestamp("Password for group %d set by %s", groupnum, name);
 
 }
 
-static void cmd_purge(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_purge(Tox *m, uint32_t friendnum, int argc, char **argv, const struct Token *tokens)
 {
     const char *outmsg = NULL;
 
-    if (!friend_is_master(m, friendnum)) {
-        authent_failed(m, friendnum);
-        return;
-    }
-
-    if (argc < 1) {
-        outmsg = "Error: number > 0 required";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
-        return;
-    }
-
     uint64_t days = (uint64_t) atoi(argv[1]);
 
     if (days <= 0) {
         outmsg = "Error: number > 0 required";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
     uint64_t seconds = days * SECONDS_IN_DAY;
     Tox_Bot.inactive_limit = seconds;
 
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t nlen = tox_friend_get_name_size(m, friendnum, NULL);
-    name[nlen] = '\0';
+    const char *name = friend_get_name(m, friendnum);
 
     char msg[MAX_COMMAND_LENGTH];
     snprintf(msg, sizeof(msg), "Purge time set to %"PRIu64" days", days);
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) msg, strlen(msg), NULL);
+    outbox_send(m, friendnum, msg, strlen(msg));
 
     log_timestamp("Purge time set to %"PRIu64" days by %s", days, name);
+    request_groups_save();
 }
 
-static void cmd_status(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_status(Tox *m, uint32_t friendnum, int argc, char **argv, const struct Token *tokens)
 {
     const char *outmsg = NULL;
 
-    if (!friend_is_master(m, friendnum)) {
-        authent_failed(m, friendnum);
-        return;
-    }
-
-    if (argc < 1) {
-        outmsg = "Error: status required";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
-        return;
-    }
-
     TOX_USER_STATUS type;
     const char *status = argv[1];
 
@@ -614,77 +631,45 @@ static void cmd_status(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_CO
         type = TOX_USER_STATUS_BUSY;
     } else {
         outmsg = "Invalid status. Valid statuses are: online, busy and away.";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
     tox_self_set_status(m, type);
 
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t nlen = tox_friend_get_name_size(m, friendnum, NULL);
-    name[nlen] = '\0';
+    const char *name = friend_get_name(m, friendnum);
 
     log_timestamp("%s set status to %s", name, status);
-    save_data(m, DATA_FILE);
+    request_save();
 }
 
-static void cmd_statusmessage(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_statusmessage(Tox *m, uint32_t friendnum, int argc, char **argv, const struct Token *tokens)
 {
     const char *outmsg = NULL;
 
-    if (!friend_is_master(m, friendnum)) {
-        authent_failed(m, friendnum);
-        return;
-    }
-
-    if (argc < 1) {
-        outmsg = "Error: message required";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
-        return;
-    }
-
-    if (argv[1][0] != '\"') {
+    if (!tokens[1].quoted) {
         outmsg = "Error: message must be enclosed in quotes";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
-    /* remove opening and closing quotes */
-    char msg[MAX_COMMAND_LENGTH];
-    snprintf(msg, sizeof(msg), "%s", &argv[1][1]);
-    int len = strlen(msg) - 1;
-    msg[len] = '\0';
+    const char *msg = argv[1];
 
-    tox_self_set_status_message(m, (uint8_t *) msg, len, NULL);
+    tox_self_set_status_message(m, (uint8_t *) msg, tokens[1].length, NULL);
 
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t nlen = tox_friend_get_name_size(m, friendnum, NULL);
-    name[nlen] = '\0';
+    const char *name = friend_get_name(m, friendnum);
 
     log_timestamp("%s set status message to \"%s\"", name, msg);
-    save_data(m, DATA_FILE);
+    request_save();
 }
 
-static void cmd_title_set(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_title_set(Tox *m, uint32_t friendnum, int argc, char **argv, const struct Token *tokens)
 {
     const char *outmsg = NULL;
 
-    if (!friend_is_master(m, friendnum)) {
-        authent_failed(m, friendnum);
-        return;
-    }
-
-    if (argc < 2) {
-        outmsg = "Error: Two arguments are required";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
-        return;
-    }
-
-    if (argv[2][0] != '\"') {
+    if (!tokens[2].quoted) {
         outmsg = "Error: title must be enclosed in quotes";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
@@ -692,20 +677,14 @@ static void cmd_title_set(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX
 
     if (groupnum == 0 && strcmp(argv[1], "0")) {
         outmsg = "Error: Invalid group number";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
-    /* remove opening and closing quotes */
-    char title[MAX_COMMAND_LENGTH];
-    snprintf(title, sizeof(title), "%s", &argv[2][1]);
-    int len = strlen(title) - 1;
-    title[len] = '\0';
+    const char *title = argv[2];
+    int len = tokens[2].length;
 
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t nlen = tox_friend_get_name_size(m, friendnum, NULL);
-    name[nlen] = '\0';
+    const char *name = friend_get_name(m, friendnum);
 
     TOX_ERR_CONFERENCE_TITLE err;
 
@@ -716,107 +695,236 @@ static void cmd_title_set(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX
         return;
     }
 
-    int idx = group_index(groupnum);
-    memcpy(Tox_Bot.g_chats[idx].title, title, len + 1);
-    Tox_Bot.g_chats[idx].title_len = len;
+    group_set_title(groupnum, title, len);
+    request_groups_save();
 
     outmsg = "Group title set";
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    outbox_send(m, friendnum, outmsg, strlen(outmsg));
     log_timestamp("%s set group %d title to %s", name, groupnum, title);
 }
 
-/* Parses input command and puts args into arg array.
-   Returns number of arguments on success, -1 on failure. */
-static int parse_command(const char *input, char (*args)[MAX_COMMAND_LENGTH])
+static void cmd_unblock(Tox *m, uint32_t friendnum, int argc, char **argv, const struct Token *tokens)
 {
-    char *cmd = strdup(input);
+    const char *outmsg = NULL;
 
-    if (cmd == NULL) {
-        exit(EXIT_FAILURE);
+    const char *id = argv[1];
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+
+    if (!parse_key_arg(id, public_key)) {
+        outmsg = "Error: Invalid Tox ID";
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
+        return;
     }
 
-    int num_args = 0;
-    int i = 0;    /* index of last char in an argument */
+    int ret = key_list_remove(&Tox_Bot.blocked_keys, public_key);
 
-    /* characters wrapped in double quotes count as one arg */
-    while (num_args < MAX_NUM_ARGS) {
-        int qt_ofst = 0;    /* set to 1 to offset index for quote char at end of arg */
+    if (ret == -1) {
+        outmsg = "Error: Failed to update blocklist";
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
 
-        if (*cmd == '\"') {
-            qt_ofst = 1;
-            i = char_find(1, cmd, '\"');
+    if (ret == 0) {
+        outmsg = "ID is not blocked";
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
 
-            if (cmd[i] == '\0') {
-                free(cmd);
-                return -1;
-            }
-        } else {
-            i = char_find(0, cmd, ' ');
-        }
+    friends_invalidate_roles();
 
-        memcpy(args[num_args], cmd, i + qt_ofst);
-        args[num_args++][i + qt_ofst] = '\0';
+    const char *name = friend_get_name(m, friendnum);
 
-        if (cmd[i] == '\0') {  /* no more args */
-            break;
-        }
+    log_timestamp("%s unblocked: %s", name, id);
+    outmsg = "ID removed from blocklist";
+    outbox_send(m, friendnum, outmsg, strlen(outmsg));
+}
+
+static void cmd_unmaster(Tox *m, uint32_t friendnum, int argc, char **argv, const struct Token *tokens)
+{
+    const char *outmsg = NULL;
 
-        char tmp[MAX_COMMAND_LENGTH];
-        snprintf(tmp, sizeof(tmp), "%s", &cmd[i + 1]);
-        strcpy(cmd, tmp);    /* tmp will always fit inside cmd */
+    const char *id = argv[1];
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+
+    if (!parse_key_arg(id, public_key)) {
+        outmsg = "Error: Invalid Tox ID";
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    int ret = key_list_remove(&Tox_Bot.master_keys, public_key);
+
+    if (ret == -1) {
+        outmsg = "Error: Failed to update masterkeys list";
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
+        return;
     }
 
-    free(cmd);
-    return num_args;
+    if (ret == 0) {
+        outmsg = "ID is not in the masterkeys list";
+        outbox_send(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    friends_invalidate_roles();
+
+    const char *name = friend_get_name(m, friendnum);
+
+    log_timestamp("%s removed master: %s", name, id);
+    outmsg = "ID removed from masterkeys list";
+    outbox_send(m, friendnum, outmsg, strlen(outmsg));
 }
 
-static struct {
-    const char *name;
-    void (*func)(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH]);
-} commands[] = {
-    { "default",          cmd_default       },
-    { "group",            cmd_group         },
-    { "gmessage",         cmd_gmessage      },
-    { "help",             cmd_help          },
-    { "id",               cmd_id            },
-    { "info",             cmd_info          },
-    { "invite",           cmd_invite        },
-    { "leave",            cmd_leave         },
-    { "master",           cmd_master        },
-    { "name",             cmd_name          },
-    { "passwd",           cmd_passwd        },
-    { "purge",            cmd_purge         },
-    { "status",           cmd_status        },
-    { "statusmessage",    cmd_statusmessage },
-    { "title",            cmd_title_set     },
-    { NULL,               NULL              },
+typedef void Command_Func(Tox *m, uint32_t friendnum, int argc, char **argv, const struct Token *tokens);
+
+struct Command {
+    const char   *name;
+    Command_Func *func;
+    Friend_Role   role;      // FRIEND_ROLE_MASTER for privileged commands
+    uint8_t       min_args;  // not counting the command name
+    uint8_t       max_args;
+    const char   *usage;
 };
 
-static int do_command(Tox *m, uint32_t friendnum, int num_args, char (*args)[MAX_COMMAND_LENGTH])
+/*
+ * The command table is a perfect hash on the first and last chars of the name, so dispatch is a
+ * single probe and one strcmp(). The slots are computed at compile time from the COMMAND_HASH()
+ * designators below; a new command must hash to an empty slot. A collision would silently replace
+ * the earlier command, so the Makefile builds with -Werror=override-init to reject it, and
+ * commands_init() checks that every entry sits in the slot its name hashes to.
+ */
+#define COMMAND_TABLE_SIZE 64
+#define COMMAND_HASH(first, last) (((unsigned) (first) + (unsigned) (last) * 8) % COMMAND_TABLE_SIZE)
+
+static const struct Command commands[COMMAND_TABLE_SIZE] = {
+    [COMMAND_HASH('b', 'k')] = { "block",         cmd_block,         FRIEND_ROLE_MASTER, 1, 1, "block <id>"                    },
+    [COMMAND_HASH('b', 't')] = { "broadcast",     cmd_broadcast,     FRIEND_ROLE_MASTER, 1, 1, "broadcast \"<msg>\""           },
+    [COMMAND_HASH('d', 't')] = { "default",       cmd_default,       FRIEND_ROLE_MASTER, 1, 1, "default <n>"                   },
+    [COMMAND_HASH('g', 't')] = { "gbroadcast",    cmd_gbroadcast,    FRIEND_ROLE_MASTER, 1, 1, "gbroadcast \"<msg>\""          },
+    [COMMAND_HASH('g', 'p')] = { "group",         cmd_group,         FRIEND_ROLE_NORMAL, 1, 2, "group <text | audio> [pass]"   },
+    [COMMAND_HASH('g', 'e')] = { "gmessage",      cmd_gmessage,      FRIEND_ROLE_MASTER, 2, 2, "gmessage <n> \"<msg>\""        },
+    [COMMAND_HASH('h', 'p')] = { "help",          cmd_help,          FRIEND_ROLE_NORMAL, 0, 0, "help"                          },
+    [COMMAND_HASH('i', 'd')] = { "id",            cmd_id,            FRIEND_ROLE_NORMAL, 0, 0, "id"                            },
+    [COMMAND_HASH('i', 'o')] = { "info",          cmd_info,          FRIEND_ROLE_NORMAL, 0, 0, "info"                          },
+    [COMMAND_HASH('i', 'e')] = { "invite",        cmd_invite,        FRIEND_ROLE_NORMAL, 0, 2, "invite [n] [pass]"             },
+    [COMMAND_HASH('l', 'e')] = { "leave",         cmd_leave,         FRIEND_ROLE_MASTER, 1, 1, "leave <n>"                     },
+    [COMMAND_HASH('m', 'r')] = { "master",        cmd_master,        FRIEND_ROLE_MASTER, 1, 1, "master <id>"                   },
+    [COMMAND_HASH('n', 'e')] = { "name",          cmd_name,          FRIEND_ROLE_MASTER, 1, 1, "name <name>"                   },
+    [COMMAND_HASH('p', 'd')] = { "passwd",        cmd_passwd,        FRIEND_ROLE_MASTER, 1, 2, "passwd <n> [pass]"             },
+    [COMMAND_HASH('p', 'e')] = { "purge",         cmd_purge,         FRIEND_ROLE_MASTER, 1, 1, "purge <days>"                  },
+    [COMMAND_HASH('s', 's')] = { "status",        cmd_status,        FRIEND_ROLE_MASTER, 1, 1, "status <online | busy | away>" },
+    [COMMAND_HASH('s', 'e')] = { "statusmessage", cmd_statusmessage, FRIEND_ROLE_MASTER, 1, 1, "statusmessage \"<msg>\""       },
+    [COMMAND_HASH('t', 'e')] = { "title",         cmd_title_set,     FRIEND_ROLE_MASTER, 2, 2, "title <n> \"<title>\""         },
+    [COMMAND_HASH('u', 'k')] = { "unblock",       cmd_unblock,       FRIEND_ROLE_MASTER, 1, 1, "unblock <id>"                  },
+    [COMMAND_HASH('u', 'r')] = { "unmaster",      cmd_unmaster,      FRIEND_ROLE_MASTER, 1, 1, "unmaster <id>"                 },
+    [COMMAND_HASH('v', 'n')] = { "version",       cmd_version,       FRIEND_ROLE_NORMAL, 0, 0, "version"                       },
+};
+
+/* Returns false if a command table entry's designator doesn't match its name. */
+static bool check_command_table(void)
 {
-    for (size_t i = 0; commands[i].name; ++i) {
-        if (strcmp(args[0], commands[i].name) == 0) {
-            (commands[i].func)(m, friendnum, num_args - 1, args);
-            return 0;
+    for (size_t i = 0; i < COMMAND_TABLE_SIZE; ++i) {
+        const char *name = commands[i].name;
+
+        if (name == NULL) {
+            continue;
         }
+
+        if (COMMAND_HASH((uint8_t) name[0], (uint8_t) name[strlen(name) - 1]) != i) {
+            fprintf(stderr, "Command '%s' is in slot %zu of the command table but hashes elsewhere\n", name, i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int commands_init(Tox *m)
+{
+    if (!check_command_table()) {
+        return -1;
+    }
+
+    build_id_reply(m);
+
+    int len = snprintf(replies.version, sizeof(replies.version), "Tox_Bot version %s (toxcore %d.%d.%d)", VERSION,
+                       tox_version_major(), tox_version_minor(), tox_version_patch());
+    replies.version_length = MIN((size_t) MAX(len, 0), sizeof(replies.version) - 1);
+
+    return 0;
+}
+
+/* Returns the table entry for the command `name` of length `length`, or NULL if there is no such command. */
+static const struct Command *find_command(const char *name, size_t length)
+{
+    if (length == 0) {
+        return NULL;
+    }
+
+    const struct Command *cmd = &commands[COMMAND_HASH((uint8_t) name[0], (uint8_t) name[length - 1])];
+
+    if (cmd->name == NULL || strcmp(name, cmd->name) != 0) {
+        return NULL;
+    }
+
+    return cmd;
+}
+
+static void send_usage(Tox *m, uint32_t friendnum, const struct Command *cmd)
+{
+    char outmsg[MAX_COMMAND_LENGTH];
+    snprintf(outmsg, sizeof(outmsg), "Usage: %s", cmd->usage);
+    outbox_send(m, friendnum, outmsg, strlen(outmsg));
+}
+
+/*
+ * Runs the command named by args[0]. Permission and argument counts are checked here from the
+ * command table, so handlers only run for callers and arguments they accept.
+ */
+static int do_command(Tox *m, uint32_t friendnum, int num_args, char **args, const struct Token *tokens)
+{
+    const struct Command *cmd = find_command(args[0], tokens[0].length);
+
+    if (cmd == NULL) {
+        return -1;
+    }
+
+    if (cmd->role == FRIEND_ROLE_MASTER && !friend_is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return 0;
     }
 
-    return -1;
+    int argc = num_args - 1;
+
+    if (argc < cmd->min_args || argc > cmd->max_args) {
+        send_usage(m, friendnum, cmd);
+        return 0;
+    }
+
+    cmd->func(m, friendnum, argc, args, tokens);
+
+    return 0;
 }
 
-int execute(Tox *m, uint32_t friendnum, const char *input, int length)
+int execute(Tox *m, uint32_t friendnum, char *input, int length)
 {
     if (length >= MAX_COMMAND_LENGTH) {
         return -1;
     }
 
-    char args[MAX_NUM_ARGS][MAX_COMMAND_LENGTH];
-    int num_args = parse_command(input, args);
+    struct Token tokens[MAX_NUM_ARGS];
+    int num_args = tokenize(input, length, tokens, MAX_NUM_ARGS);
 
-    if (num_args == -1) {
+    if (num_args <= 0) {
         return -1;
     }
 
-    return do_command(m, friendnum, num_args, args);
+    char *args[MAX_NUM_ARGS];
+
+    for (int i = 0; i < num_args; ++i) {
+        args[i] = input + tokens[i].offset;
+    }
+
+    return do_command(m, friendnum, num_args, args, tokens);
 }
 
@@ -23,7 +23,22 @@
 #ifndef COMMANDS_H
 #define COMMANDS_H
 
-int execute(Tox *m, int friendnumber, const char *input, int length);
+/*
+ * Checks the command table and builds the replies that don't change from request to request. This
+ * must be called once the profile is loaded.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the command table is inconsistent.
+ */
+int commands_init(Tox *m);
+
+/*
+ * Tokenizes `input` in place and runs the command it names. `input[length]` must be writable.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the input is not a valid command.
+ */
+int execute(Tox *m, int friendnumber, char *input, int length);
 
 #endif    /* COMMANDS_H */
 
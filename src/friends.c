@@ -0,0 +1,571 @@
+/*  friends.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <tox/tox.h>
+
+#include "friends.h"
+#include "keylist.h"
+#include "log.h"
+#include "misc.h"
+#include "outbox.h"
+#include "toxbot.h"
+
+#define MIN_FRIENDS_CAPACITY 64
+
+/* Sustained and burst rate at which a friend may run commands */
+#define COMMAND_RATE 1.0
+#define COMMAND_BURST 5.0
+
+extern struct Tox_Bot Tox_Bot;
+
+static struct Friend *friends;
+static uint32_t friends_capacity;
+
+/* Min-heap of offline friendnumbers ordered by last_online */
+static uint32_t *inactive_queue;
+static size_t queue_size;
+static size_t queue_capacity;
+
+/* Doubly linked list of friends from most to least recently active, by 1-based friendnumber */
+static uint32_t lru_head;
+static uint32_t lru_tail;
+
+/* Returns the entry for friendnumber, growing the array if needed. Returns NULL on allocation failure. */
+static struct Friend *get_friend(uint32_t friendnumber)
+{
+    if (friendnumber < friends_capacity) {
+        return &friends[friendnumber];
+    }
+
+    uint32_t new_capacity = MAX(friends_capacity, MIN_FRIENDS_CAPACITY);
+
+    while (new_capacity <= friendnumber) {
+        new_capacity *= 2;
+    }
+
+    struct Friend *tmp = realloc(friends, new_capacity * sizeof(struct Friend));
+
+    if (tmp == NULL) {
+        return NULL;
+    }
+
+    memset(&tmp[friends_capacity], 0, (new_capacity - friends_capacity) * sizeof(struct Friend));
+
+    friends = tmp;
+    friends_capacity = new_capacity;
+
+    return &friends[friendnumber];
+}
+
+static void queue_set(size_t pos, uint32_t friendnumber)
+{
+    inactive_queue[pos] = friendnumber;
+    friends[friendnumber].queue_pos = pos + 1;
+}
+
+static bool queue_less(size_t a, size_t b)
+{
+    return friends[inactive_queue[a]].last_online < friends[inactive_queue[b]].last_online;
+}
+
+static void queue_swap(size_t a, size_t b)
+{
+    uint32_t tmp = inactive_queue[a];
+    queue_set(a, inactive_queue[b]);
+    queue_set(b, tmp);
+}
+
+static void queue_sift_up(size_t pos)
+{
+    while (pos > 0) {
+        size_t parent = (pos - 1) / 2;
+
+        if (!queue_less(pos, parent)) {
+            break;
+        }
+
+        queue_swap(pos, parent);
+        pos = parent;
+    }
+}
+
+static void queue_sift_down(size_t pos)
+{
+    while (true) {
+        size_t smallest = pos;
+        size_t left = pos * 2 + 1;
+        size_t right = left + 1;
+
+        if (left < queue_size && queue_less(left, smallest)) {
+            smallest = left;
+        }
+
+        if (right < queue_size && queue_less(right, smallest)) {
+            smallest = right;
+        }
+
+        if (smallest == pos) {
+            break;
+        }
+
+        queue_swap(pos, smallest);
+        pos = smallest;
+    }
+}
+
+/* Appends friendnumber to the queue without restoring the heap order. Returns -1 on allocation failure. */
+static int queue_append(uint32_t friendnumber)
+{
+    if (queue_size == queue_capacity) {
+        size_t new_capacity = MAX(queue_capacity * 2, MIN_FRIENDS_CAPACITY);
+        uint32_t *tmp = realloc(inactive_queue, new_capacity * sizeof(uint32_t));
+
+        if (tmp == NULL) {
+            return -1;
+        }
+
+        inactive_queue = tmp;
+        queue_capacity = new_capacity;
+    }
+
+    queue_set(queue_size++, friendnumber);
+
+    return 0;
+}
+
+static void queue_remove(uint32_t friendnumber)
+{
+    struct Friend *f = &friends[friendnumber];
+
+    if (f->queue_pos == 0) {
+        return;
+    }
+
+    size_t pos = f->queue_pos - 1;
+    f->queue_pos = 0;
+
+    if (pos == --queue_size) {
+        return;
+    }
+
+    queue_set(pos, inactive_queue[queue_size]);
+    queue_sift_up(pos);
+    queue_sift_down(friends[inactive_queue[pos]].queue_pos - 1);
+}
+
+static void lru_unlink(uint32_t friendnumber)
+{
+    struct Friend *f = &friends[friendnumber];
+
+    if (!f->lru_linked) {
+        return;
+    }
+
+    if (f->lru_prev != 0) {
+        friends[f->lru_prev - 1].lru_next = f->lru_next;
+    } else {
+        lru_head = f->lru_next;
+    }
+
+    if (f->lru_next != 0) {
+        friends[f->lru_next - 1].lru_prev = f->lru_prev;
+    } else {
+        lru_tail = f->lru_prev;
+    }
+
+    f->lru_prev = 0;
+    f->lru_next = 0;
+    f->lru_linked = false;
+}
+
+static void lru_push_front(uint32_t friendnumber)
+{
+    struct Friend *f = &friends[friendnumber];
+
+    f->lru_prev = 0;
+    f->lru_next = lru_head;
+
+    if (lru_head != 0) {
+        friends[lru_head - 1].lru_prev = friendnumber + 1;
+    } else {
+        lru_tail = friendnumber + 1;
+    }
+
+    lru_head = friendnumber + 1;
+    f->lru_linked = true;
+}
+
+/*
+ * Returns the directory entry for friendnumber with its name and public key loaded.
+ * Returns NULL if the friend doesn't exist.
+ */
+static struct Friend *load_friend_info(Tox *m, uint32_t friendnumber)
+{
+    struct Friend *f = get_friend(friendnumber);
+
+    if (f == NULL) {
+        return NULL;
+    }
+
+    if (f->info_loaded) {
+        return f;
+    }
+
+    if (!tox_friend_get_public_key(m, friendnumber, f->public_key, NULL)) {
+        return NULL;
+    }
+
+    Tox_Err_Friend_Query err;
+    size_t length = tox_friend_get_name_size(m, friendnumber, &err);
+
+    if (err == TOX_ERR_FRIEND_QUERY_OK && length <= TOX_MAX_NAME_LENGTH
+            && tox_friend_get_name(m, friendnumber, (uint8_t *) f->name, NULL)) {
+        f->name_length = length;
+    } else {
+        f->name_length = 0;
+    }
+
+    f->name[f->name_length] = '\0';
+    f->info_loaded = true;
+
+    return f;
+}
+
+static Friend_Role lookup_role(Tox *m, uint32_t friendnumber)
+{
+    const uint8_t *public_key = friend_get_public_key(m, friendnumber);
+
+    if (public_key == NULL) {
+        return FRIEND_ROLE_UNKNOWN;
+    }
+
+    if (key_list_contains(&Tox_Bot.master_keys, public_key)) {
+        return FRIEND_ROLE_MASTER;
+    }
+
+    if (key_list_contains(&Tox_Bot.blocked_keys, public_key)) {
+        return FRIEND_ROLE_BLOCKED;
+    }
+
+    return FRIEND_ROLE_NORMAL;
+}
+
+Friend_Role friend_get_role(Tox *m, uint32_t friendnumber)
+{
+    if (friendnumber < friends_capacity && friends[friendnumber].role != FRIEND_ROLE_UNKNOWN) {
+        return friends[friendnumber].role;
+    }
+
+    Friend_Role role = lookup_role(m, friendnumber);
+    struct Friend *f = get_friend(friendnumber);
+
+    if (f != NULL) {
+        f->role = role;
+    }
+
+    return role;
+}
+
+void friends_invalidate_roles(void)
+{
+    for (uint32_t i = 0; i < friends_capacity; ++i) {
+        friends[i].role = FRIEND_ROLE_UNKNOWN;
+    }
+}
+
+void friend_reset(uint32_t friendnumber)
+{
+    if (friendnumber >= friends_capacity) {
+        return;
+    }
+
+    if (friends[friendnumber].online) {
+        --Tox_Bot.num_online_friends;
+    }
+
+    queue_remove(friendnumber);
+    lru_unlink(friendnumber);
+    outbox_clear(friendnumber);
+
+    memset(&friends[friendnumber], 0, sizeof(struct Friend));
+}
+
+/* Sets the online flag of friendnumber and moves it into or out of the inactivity queue to match. */
+static void set_online(uint32_t friendnumber, bool online)
+{
+    friends[friendnumber].online = online;
+
+    if (online) {
+        queue_remove(friendnumber);
+    } else {
+        outbox_clear(friendnumber);
+        friend_set_last_online(friendnumber, get_time());
+    }
+}
+
+void friend_set_connection_status(uint32_t friendnumber, TOX_CONNECTION connection_status)
+{
+    struct Friend *f = get_friend(friendnumber);
+
+    if (f == NULL) {
+        return;
+    }
+
+    bool online = connection_status != TOX_CONNECTION_NONE;
+
+    if (online == f->online) {
+        return;  // e.g. a switch between TCP and UDP
+    }
+
+    Tox_Bot.num_online_friends += online ? 1 : -1;
+
+    friend_touch(friendnumber);
+    set_online(friendnumber, online);
+}
+
+void friend_set_last_online(uint32_t friendnumber, uint64_t last_online)
+{
+    struct Friend *f = get_friend(friendnumber);
+
+    if (f == NULL || f->online) {
+        return;
+    }
+
+    f->last_online = last_online;
+
+    if (f->queue_pos == 0) {
+        if (queue_append(friendnumber) != 0) {
+            return;
+        }
+
+        queue_sift_up(queue_size - 1);
+        return;
+    }
+
+    queue_sift_up(f->queue_pos - 1);
+    queue_sift_down(f->queue_pos - 1);
+}
+
+bool friends_get_inactive(uint64_t cutoff, uint32_t *friendnumber)
+{
+    if (queue_size == 0 || friends[inactive_queue[0]].last_online >= cutoff) {
+        return false;
+    }
+
+    *friendnumber = inactive_queue[0];
+
+    return true;
+}
+
+bool friend_is_online(uint32_t friendnumber)
+{
+    return friendnumber < friends_capacity && friends[friendnumber].online;
+}
+
+const char *friend_get_name(Tox *m, uint32_t friendnumber)
+{
+    const struct Friend *f = load_friend_info(m, friendnumber);
+    return f != NULL ? f->name : "";
+}
+
+const uint8_t *friend_get_public_key(Tox *m, uint32_t friendnumber)
+{
+    const struct Friend *f = load_friend_info(m, friendnumber);
+    return f != NULL ? f->public_key : NULL;
+}
+
+void friend_set_name(uint32_t friendnumber, const uint8_t *name, size_t length)
+{
+    struct Friend *f = get_friend(friendnumber);
+
+    if (f == NULL || !f->info_loaded) {
+        return;  // the name is fetched along with the public key when it's first needed
+    }
+
+    length = MIN(length, TOX_MAX_NAME_LENGTH);
+    memcpy(f->name, name, length);
+    f->name[length] = '\0';
+    f->name_length = length;
+}
+
+bool friend_take_command_token(uint32_t friendnumber, uint64_t now)
+{
+    struct Friend *f = get_friend(friendnumber);
+
+    if (f == NULL) {
+        return true;
+    }
+
+    if (!f->command_bucket_init) {
+        token_bucket_init(&f->command_bucket, COMMAND_RATE, COMMAND_BURST, now);
+        f->command_bucket_init = true;
+    }
+
+    return token_bucket_take(&f->command_bucket, now);
+}
+
+void friend_touch(uint32_t friendnumber)
+{
+    struct Friend *f = get_friend(friendnumber);
+
+    if (f == NULL) {
+        return;
+    }
+
+    f->last_activity = get_time();
+
+    lru_unlink(friendnumber);
+    lru_push_front(friendnumber);
+}
+
+bool friends_get_evictable(Tox *m, uint32_t *friendnumber)
+{
+    for (uint32_t i = lru_tail; i != 0; i = friends[i - 1].lru_prev) {
+        if (friend_get_role(m, i - 1) != FRIEND_ROLE_MASTER) {
+            *friendnumber = i - 1;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static int cmp_last_online(const void *a, const void *b)
+{
+    uint64_t x = friends[*(const uint32_t *) a].last_online;
+    uint64_t y = friends[*(const uint32_t *) b].last_online;
+
+    return (x > y) - (x < y);
+}
+
+int friends_init(Tox *m)
+{
+    size_t size = tox_self_get_friend_list_size(m);
+
+    if (size == 0) {
+        return 0;
+    }
+
+    uint32_t *list = malloc(size * sizeof(uint32_t));
+
+    if (list == NULL) {
+        return -1;
+    }
+
+    tox_self_get_friend_list(m, list);
+
+    size_t num_valid = 0;
+
+    for (size_t i = 0; i < size; ++i) {
+        TOX_ERR_FRIEND_GET_LAST_ONLINE err;
+        uint64_t last_online = tox_friend_get_last_online(m, list[i], &err);
+        struct Friend *f = get_friend(list[i]);
+
+        if (err != TOX_ERR_FRIEND_GET_LAST_ONLINE_OK || f == NULL || f->queue_pos != 0) {
+            continue;
+        }
+
+        f->last_online = last_online;
+
+        if (queue_append(list[i]) != 0) {
+            free(list);
+            return -1;
+        }
+
+        list[num_valid++] = list[i];
+    }
+
+    /* seed the activity list so that the most recently online friend is at the front */
+    qsort(list, num_valid, sizeof(uint32_t), cmp_last_online);
+
+    for (size_t i = 0; i < num_valid; ++i) {
+        if (!friends[list[i]].lru_linked) {
+            lru_push_front(list[i]);
+        }
+    }
+
+    free(list);
+
+    /* heapify bottom-up, which is linear in the number of friends */
+    for (size_t i = queue_size / 2; i-- > 0;) {
+        queue_sift_down(i);
+    }
+
+    return 0;
+}
+
+void friends_check_online(Tox *m)
+{
+    size_t size = tox_self_get_friend_list_size(m);
+    uint32_t *list = malloc(size * sizeof(uint32_t));
+
+    if (list == NULL) {
+        return;
+    }
+
+    tox_self_get_friend_list(m, list);
+
+    int num_online = 0;
+    int num_mismatched = 0;
+
+    for (size_t i = 0; i < size; ++i) {
+        bool online = tox_friend_get_connection_status(m, list[i], NULL) != TOX_CONNECTION_NONE;
+        bool tracked = list[i] < friends_capacity && friends[list[i]].online;
+
+        num_online += online;
+
+        if (online != tracked) {
+            ++num_mismatched;
+
+            /* fix the friend too, or the next connection change for it puts the drift back */
+            if (get_friend(list[i]) != NULL) {
+                set_online(list[i], online);
+            }
+        }
+    }
+
+    free(list);
+
+    if (num_online != Tox_Bot.num_online_friends || num_mismatched > 0) {
+        log_timestamp("Warning: online friend count is %d but %d friends are online (%d mismatched)",
+                      Tox_Bot.num_online_friends, num_online, num_mismatched);
+        Tox_Bot.num_online_friends = num_online;
+    }
+}
+
+void friends_free(void)
+{
+    free(friends);
+    friends = NULL;
+    friends_capacity = 0;
+
+    free(inactive_queue);
+    inactive_queue = NULL;
+    queue_size = 0;
+    queue_capacity = 0;
+
+    lru_head = 0;
+    lru_tail = 0;
+}
@@ -0,0 +1,152 @@
+/*  friends.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef FRIENDS_H
+#define FRIENDS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <tox/tox.h>
+
+#include "ratelimit.h"
+
+typedef enum Friend_Role {
+    FRIEND_ROLE_UNKNOWN = 0,  // not looked up since the friend was added or the key lists changed
+    FRIEND_ROLE_NORMAL,
+    FRIEND_ROLE_MASTER,
+    FRIEND_ROLE_BLOCKED,
+} Friend_Role;
+
+/* Per-friend state, indexed by friendnumber */
+struct Friend {
+    bool     info_loaded;  // true once name and public_key have been fetched from toxcore
+    uint8_t  public_key[TOX_PUBLIC_KEY_SIZE];
+    char     name[TOX_MAX_NAME_LENGTH + 1];
+    uint16_t name_length;
+    time_t   last_activity;  // last time the friend sent a message or changed connection status
+
+    uint8_t  role;
+    bool     online;
+    uint32_t queue_pos;    // 1-based position in the inactivity queue, or 0 if not queued
+    uint64_t last_online;  // unix time the friend was last seen online; the inactivity queue key
+    uint32_t lru_prev;     // 1-based friendnumber of the next more recently active friend, or 0
+    uint32_t lru_next;     // 1-based friendnumber of the next less recently active friend, or 0
+    bool     lru_linked;   // true if the friend is in the activity list
+
+    struct Token_Bucket command_bucket;  // limits how often the friend may run commands
+    bool     command_bucket_init;
+};
+
+/*
+ * Builds the inactivity queue and activity list from toxcore's last online times. This must be called once after the
+ * profile is loaded.
+ *
+ * Returns 0 on success.
+ * Returns -1 on allocation failure.
+ */
+int friends_init(Tox *m);
+
+/*
+ * Returns the role of friendnumber. The role is looked up in the key lists the first time it's
+ * needed and cached until friends_invalidate_roles() or friend_reset() is called.
+ */
+Friend_Role friend_get_role(Tox *m, uint32_t friendnumber);
+
+/* Forgets the cached role of every friend. This must be called whenever a key list changes. */
+void friends_invalidate_roles(void);
+
+/*
+ * Clears all cached state for friendnumber and drops its queued messages. This must be called whenever
+ * a friend is added or deleted, as toxcore does not report a connection change for deleted friends.
+ */
+void friend_reset(uint32_t friendnumber);
+
+/*
+ * Records the connection status of friendnumber and keeps Tox_Bot.num_online_friends in step with it.
+ * This should be called from the friend connection status callback.
+ */
+void friend_set_connection_status(uint32_t friendnumber, TOX_CONNECTION connection_status);
+
+/*
+ * Sets the time friendnumber was last online, queueing it to be checked for inactivity. Friends that
+ * are currently online are never queued.
+ */
+void friend_set_last_online(uint32_t friendnumber, uint64_t last_online);
+
+/*
+ * Looks up the offline friend that has been inactive the longest.
+ *
+ * Returns true and sets `friendnumber` if that friend was last online before `cutoff`.
+ * Returns false if no queued friend was last online before `cutoff`.
+ */
+bool friends_get_inactive(uint64_t cutoff, uint32_t *friendnumber);
+
+/* Returns true if friendnumber is online as of its last connection change. */
+bool friend_is_online(uint32_t friendnumber);
+
+/*
+ * Returns the null terminated name of friendnumber. The name is fetched from toxcore the first time
+ * it's needed and kept up to date by friend_set_name() afterwards.
+ *
+ * The returned pointer is valid until the friend cache next changes, so it shouldn't be held across
+ * calls that add friends.
+ */
+const char *friend_get_name(Tox *m, uint32_t friendnumber);
+
+/*
+ * Returns the public key of friendnumber, or NULL if the friend doesn't exist. The same lifetime rules
+ * as friend_get_name() apply.
+ */
+const uint8_t *friend_get_public_key(Tox *m, uint32_t friendnumber);
+
+/* Updates the cached name of friendnumber. This should be called from the friend name callback. */
+void friend_set_name(uint32_t friendnumber, const uint8_t *name, size_t length);
+
+/*
+ * Takes a token from friendnumber's command rate limiter. `now` is a monotonic timestamp in microseconds.
+ *
+ * Returns false if the friend has run too many commands recently.
+ */
+bool friend_take_command_token(uint32_t friendnumber, uint64_t now);
+
+/* Marks friendnumber as active now, moving it to the front of the activity list. */
+void friend_touch(uint32_t friendnumber);
+
+/*
+ * Finds the least recently active friend who is not a master, for eviction when the friend list is
+ * full. Masters are never returned.
+ *
+ * Returns true and sets `friendnumber` if such a friend exists.
+ */
+bool friends_get_evictable(Tox *m, uint32_t *friendnumber);
+
+/*
+ * Recounts online friends from toxcore and corrects Tox_Bot.num_online_friends and the online state of
+ * each friend that has drifted from it, including its place in the inactivity queue.
+ */
+void friends_check_online(Tox *m);
+
+/* Frees all memory used by the friend cache. */
+void friends_free(void);
+
+#endif /* FRIENDS_H */
@@ -24,87 +24,455 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "toxbot.h"
 #include "groupchats.h"
+#include "misc.h"
 
-extern struct Tox_Bot Tox_Bot;
+#define MIN_GROUPS_CAPACITY 16
+#define MIN_TABLE_BITS 5
 
-void realloc_groupchats(int n)
+#define NO_SLOT UINT32_MAX
+
+struct Group_Title {
+    int  length;
+    char text[TOX_MAX_NAME_LENGTH];
+};
+
+/* Links of the expiry queue, a list of the empty groups ordered by how long they've been empty */
+struct Group_Expiry {
+    time_t   empty_since;
+    uint32_t prev;
+    uint32_t next;
+    bool     queued;
+};
+
+/*
+ * Slabs of group records, titles, passwords and expiry links, all indexed by slot. The slots of groups
+ * we've left are cleared and listed in free_slots.
+ */
+static struct Group_Chat *chats;
+static struct Group_Title *titles;
+static char (*passwords)[MAX_PASSWORD_SIZE];
+static struct Group_Expiry *expiry;
+static uint32_t chats_capacity;
+static uint32_t num_slots;  // slots handed out so far, including free ones
+static uint32_t num_groups;
+
+static uint32_t *free_slots;
+static uint32_t num_free;
+
+/* Open addressing hash table with linear probing from groupnum to 1-based slot, or 0 if empty */
+static uint32_t *table;
+static uint32_t table_bits;
+
+static uint32_t expiry_head = NO_SLOT;
+static uint32_t expiry_tail = NO_SLOT;
+
+static uint32_t table_size(void)
 {
-    if (n <= 0) {
-        free(Tox_Bot.g_chats);
-        Tox_Bot.g_chats = NULL;
-        return;
+    return table != NULL ? 1u << table_bits : 0;
+}
+
+/* Fibonacci hashing, which spreads the consecutive groupnums toxcore hands out across the table */
+static uint32_t home_bucket(uint32_t groupnum)
+{
+    return (uint32_t) (groupnum * 2654435769u) >> (32 - table_bits);
+}
+
+/* Returns the table bucket holding groupnum, or -1 if it's not registered. */
+static int64_t find_bucket(uint32_t groupnum)
+{
+    if (table == NULL) {
+        return -1;
     }
 
-    struct Group_Chat *g = realloc(Tox_Bot.g_chats, n * sizeof(struct Group_Chat));
+    uint32_t mask = table_size() - 1;
 
-    if (g == NULL) {
-        exit(EXIT_FAILURE);
+    for (uint32_t i = home_bucket(groupnum); table[i] != 0; i = (i + 1) & mask) {
+        if (chats[table[i] - 1].groupnum == groupnum) {
+            return i;
+        }
     }
 
-    Tox_Bot.g_chats = g;
+    return -1;
 }
 
-int group_add(uint32_t groupnum, uint8_t type, const char *password)
+static void table_insert(uint32_t slot)
 {
-    realloc_groupchats(Tox_Bot.chats_idx + 1);
-    memset(&Tox_Bot.g_chats[Tox_Bot.chats_idx], 0, sizeof(struct Group_Chat));
+    uint32_t mask = table_size() - 1;
+    uint32_t i = home_bucket(chats[slot].groupnum);
 
-    for (int i = 0; i <= Tox_Bot.chats_idx && i < MAX_NUM_GROUPS; ++i) {
-        if (Tox_Bot.g_chats[i].active) {
-            continue;
-        }
+    while (table[i] != 0) {
+        i = (i + 1) & mask;
+    }
 
-        memset(&Tox_Bot.g_chats[i], 0, sizeof(struct Group_Chat));
-        Tox_Bot.g_chats[i].groupnum = groupnum;
-        Tox_Bot.g_chats[i].active = true;
-        Tox_Bot.g_chats[i].type = type;
+    table[i] = slot + 1;
+}
 
-        if (password) {
-            Tox_Bot.g_chats[i].has_pass = true;
-            snprintf(Tox_Bot.g_chats[i].password, sizeof(Tox_Bot.g_chats[i].password), "%s", password);
+/* Removes the entry in `bucket`, shifting later entries of its probe run back so that no tombstone is needed. */
+static void table_remove(uint32_t bucket)
+{
+    uint32_t mask = table_size() - 1;
+    uint32_t i = bucket;
+    uint32_t j = bucket;
+
+    while (true) {
+        j = (j + 1) & mask;
+
+        if (table[j] == 0) {
+            break;
         }
 
-        if (Tox_Bot.chats_idx == i) {
-            ++Tox_Bot.chats_idx;
+        uint32_t home = home_bucket(chats[table[j] - 1].groupnum);
+
+        /* the entry at j may move to i only if its home bucket isn't cyclically within (i, j] */
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            table[i] = table[j];
+            i = j;
         }
+    }
 
+    table[i] = 0;
+}
+
+/* Grows the table so that it stays at most half full with `count` entries. Returns -1 on allocation failure. */
+static int table_reserve(uint32_t count)
+{
+    if (count * 2 <= table_size()) {
         return 0;
     }
 
-    return -1;
+    uint32_t new_bits = MIN_TABLE_BITS;
+
+    while ((1u << new_bits) < count * 2) {
+        ++new_bits;
+    }
+
+    uint32_t *new_table = calloc(1u << new_bits, sizeof(uint32_t));
+
+    if (new_table == NULL) {
+        return -1;
+    }
+
+    free(table);
+    table = new_table;
+    table_bits = new_bits;
+
+    for (uint32_t i = 0; i < num_slots; ++i) {
+        if (chats[i].active) {
+            table_insert(i);
+        }
+    }
+
+    return 0;
 }
 
-void group_leave(uint32_t groupnum)
+static int grow_slab(void **slab, size_t elem_size, uint32_t capacity)
 {
-    int i;
+    void *tmp = realloc(*slab, capacity * elem_size);
 
-    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
-        if (Tox_Bot.g_chats[i].active && Tox_Bot.g_chats[i].groupnum == groupnum) {
-            memset(&Tox_Bot.g_chats[i], 0, sizeof(struct Group_Chat));
-            break;
-        }
+    if (tmp == NULL) {
+        return -1;
     }
 
-    for (i = Tox_Bot.chats_idx; i > 0; --i) {
-        if (Tox_Bot.g_chats[i - 1].active) {
-            break;
+    *slab = tmp;
+
+    return 0;
+}
+
+/* Appends slot to the expiry queue. Groups only ever become empty "now", so the queue stays in order. */
+static void expiry_push(uint32_t slot, time_t empty_since)
+{
+    struct Group_Expiry *e = &expiry[slot];
+
+    e->empty_since = empty_since;
+    e->prev = expiry_tail;
+    e->next = NO_SLOT;
+    e->queued = true;
+
+    if (expiry_tail != NO_SLOT) {
+        expiry[expiry_tail].next = slot;
+    } else {
+        expiry_head = slot;
+    }
+
+    expiry_tail = slot;
+}
+
+static void expiry_unlink(uint32_t slot)
+{
+    struct Group_Expiry *e = &expiry[slot];
+
+    if (!e->queued) {
+        return;
+    }
+
+    if (e->prev != NO_SLOT) {
+        expiry[e->prev].next = e->next;
+    } else {
+        expiry_head = e->next;
+    }
+
+    if (e->next != NO_SLOT) {
+        expiry[e->next].prev = e->prev;
+    } else {
+        expiry_tail = e->prev;
+    }
+
+    e->queued = false;
+}
+
+static void clear_slot(uint32_t slot)
+{
+    expiry_unlink(slot);
+    memset(&expiry[slot], 0, sizeof(struct Group_Expiry));
+    memset(&chats[slot], 0, sizeof(struct Group_Chat));
+    memset(&titles[slot], 0, sizeof(struct Group_Title));
+    memset(passwords[slot], 0, MAX_PASSWORD_SIZE);
+}
+
+/* Returns the slot of groupnum, or -1 if it's not registered. */
+static int64_t find_slot(uint32_t groupnum)
+{
+    int64_t bucket = find_bucket(groupnum);
+
+    if (bucket == -1) {
+        return -1;
+    }
+
+    return table[bucket] - 1;
+}
+
+/* Returns a free slot, growing the slabs if there is none. Returns -1 on allocation failure. */
+static int64_t alloc_slot(void)
+{
+    if (num_free > 0) {
+        return free_slots[--num_free];
+    }
+
+    if (num_slots == chats_capacity) {
+        uint32_t new_capacity = chats_capacity > 0 ? chats_capacity * 2 : MIN_GROUPS_CAPACITY;
+
+        /* the slabs that were grown before a failure are just larger than they need to be */
+        if (grow_slab((void **) &chats, sizeof(*chats), new_capacity) != 0
+                || grow_slab((void **) &titles, sizeof(*titles), new_capacity) != 0
+                || grow_slab((void **) &passwords, sizeof(*passwords), new_capacity) != 0
+                || grow_slab((void **) &expiry, sizeof(*expiry), new_capacity) != 0
+                || grow_slab((void **) &free_slots, sizeof(*free_slots), new_capacity) != 0) {
+            return -1;
         }
+
+        chats_capacity = new_capacity;
     }
 
-    Tox_Bot.chats_idx = i;
-    realloc_groupchats(i);
+    /* clear_slot() expects the expiry links of a slot to be valid */
+    memset(&expiry[num_slots], 0, sizeof(struct Group_Expiry));
+
+    return num_slots++;
 }
 
-int group_index(uint32_t groupnum)
+int group_add(uint32_t groupnum, uint8_t type, const char *password)
 {
-    for (int i = 0; i < Tox_Bot.chats_idx; ++i) {
-        if (Tox_Bot.g_chats[i].active && Tox_Bot.g_chats[i].groupnum == groupnum) {
-            return i;
+    if (password != NULL && strlen(password) >= MAX_PASSWORD_SIZE) {
+        return -1;
+    }
+
+    int64_t slot = find_slot(groupnum);
+
+    if (slot == -1) {
+        if (table_reserve(num_groups + 1) != 0) {
+            return -1;
         }
+
+        slot = alloc_slot();
+
+        if (slot == -1) {
+            return -1;
+        }
+
+        chats[slot].groupnum = groupnum;
+        table_insert(slot);
+        ++num_groups;
     }
 
-    return -1;
+    clear_slot(slot);
+
+    chats[slot].groupnum = groupnum;
+    chats[slot].active = true;
+    chats[slot].type = type;
+
+    if (password != NULL) {
+        chats[slot].has_pass = true;
+        snprintf(passwords[slot], MAX_PASSWORD_SIZE, "%s", password);
+    }
+
+    /* we don't know of any peers until toxcore tells us about them */
+    expiry_push(slot, get_time());
+
+    return 0;
+}
+
+void group_leave(uint32_t groupnum)
+{
+    int64_t bucket = find_bucket(groupnum);
+
+    if (bucket == -1) {
+        return;
+    }
+
+    uint32_t slot = table[bucket] - 1;
+
+    table_remove(bucket);
+    clear_slot(slot);
+    free_slots[num_free++] = slot;
+    --num_groups;
+}
+
+const struct Group_Chat *group_get(uint32_t groupnum)
+{
+    int64_t slot = find_slot(groupnum);
+    return slot != -1 ? &chats[slot] : NULL;
+}
+
+void group_set_peer_count(uint32_t groupnum, uint32_t num_peers)
+{
+    int64_t slot = find_slot(groupnum);
+
+    if (slot == -1) {
+        return;
+    }
+
+    chats[slot].num_peers = num_peers;
+
+    if (num_peers > 1) {
+        expiry_unlink(slot);
+    } else if (!expiry[slot].queued) {
+        expiry_push(slot, get_time());
+    }
+}
+
+int64_t group_pop_expired(time_t cur_time, uint64_t grace)
+{
+    if (expiry_head == NO_SLOT || !timed_out(expiry[expiry_head].empty_since, cur_time, grace)) {
+        return -1;
+    }
+
+    uint32_t slot = expiry_head;
+    expiry_unlink(slot);
+
+    return chats[slot].groupnum;
+}
+
+const char *group_get_title(uint32_t groupnum, size_t *length)
+{
+    int64_t slot = find_slot(groupnum);
+
+    if (slot == -1) {
+        return NULL;
+    }
+
+    *length = titles[slot].length;
+
+    return titles[slot].text;
+}
+
+void group_set_title(uint32_t groupnum, const char *title, size_t length)
+{
+    int64_t slot = find_slot(groupnum);
+
+    if (slot == -1) {
+        return;
+    }
+
+    struct Group_Title *t = &titles[slot];
+    t->length = copy_tox_str(t->text, sizeof(t->text), title, length);
+}
+
+int group_set_password(uint32_t groupnum, const char *password)
+{
+    int64_t slot = find_slot(groupnum);
+
+    if (slot == -1) {
+        return -1;
+    }
+
+    if (password == NULL) {
+        chats[slot].has_pass = false;
+        memset(passwords[slot], 0, MAX_PASSWORD_SIZE);
+        return 0;
+    }
+
+    if (strlen(password) >= MAX_PASSWORD_SIZE) {
+        return -1;
+    }
+
+    chats[slot].has_pass = true;
+    snprintf(passwords[slot], MAX_PASSWORD_SIZE, "%s", password);
+
+    return 0;
+}
+
+const char *group_get_password(uint32_t groupnum)
+{
+    int64_t slot = find_slot(groupnum);
+
+    if (slot == -1 || !chats[slot].has_pass) {
+        return NULL;
+    }
+
+    return passwords[slot];
+}
+
+bool group_check_password(uint32_t groupnum, const char *password)
+{
+    int64_t slot = find_slot(groupnum);
+
+    if (slot == -1) {
+        return false;
+    }
+
+    if (!chats[slot].has_pass) {
+        return true;
+    }
+
+    return password != NULL && strcmp(password, passwords[slot]) == 0;
+}
+
+uint32_t groups_num_slots(void)
+{
+    return num_slots;
+}
+
+const struct Group_Chat *group_at(uint32_t idx)
+{
+    return idx < num_slots && chats[idx].active ? &chats[idx] : NULL;
 }
 
+uint32_t groups_count(void)
+{
+    return num_groups;
+}
+
+void groups_free(void)
+{
+    free(chats);
+    chats = NULL;
+    free(titles);
+    titles = NULL;
+    free(passwords);
+    passwords = NULL;
+    free(expiry);
+    expiry = NULL;
+    expiry_head = NO_SLOT;
+    expiry_tail = NO_SLOT;
+    chats_capacity = 0;
+    num_slots = 0;
+    num_groups = 0;
+
+    free(free_slots);
+    free_slots = NULL;
+    num_free = 0;
+
+    free(table);
+    table = NULL;
+    table_bits = 0;
+}
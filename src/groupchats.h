@@ -23,23 +23,102 @@
 #ifndef GROUPCHATS_H
 #define GROUPCHATS_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <tox/tox.h>
+
 #define SECONDS_IN_DAY 86400UL
 #define MAX_PASSWORD_SIZE 64
 
+/*
+ * Registry of the groups we're in, by groupnum.
+ *
+ * Records live in slabs that grow by doubling and never move a record to another slot; slots of
+ * groups we leave are reused. A hash table maps groupnums to slots, so lookups take constant time
+ * however many groups there are.
+ *
+ * The slabs are split by how often they're read: the records below, which lookups and periodic scans
+ * go through, are kept in a dense array of their own, while titles and passwords are kept in parallel
+ * arrays that are only touched when they're set or shown.
+ */
+
 struct Group_Chat {
     uint32_t groupnum;
-    bool active;
-    bool has_pass;
-    uint8_t type;
-    char title[TOX_MAX_NAME_LENGTH];
-    int title_len;
-    char password[MAX_PASSWORD_SIZE];
+    uint32_t num_peers;  /* peer count as of the last peer list change, including us */
+    uint8_t  type;
+    bool     active;
+    bool     has_pass;
 };
 
+/*
+ * Registers groupnum with an optional password. If it's already registered its record is reset.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the password is MAX_PASSWORD_SIZE chars or longer, or on allocation failure.
+ */
 int group_add(uint32_t groupnum, uint8_t type, const char *password);
+
+/* Unregisters groupnum. */
 void group_leave(uint32_t groupnum);
-int group_index(uint32_t groupnum);
-void realloc_groupchats(int n);
 
-#endif  /* GROUPCHATS_H */
+/*
+ * Returns the record of groupnum, or NULL if it's not registered. The pointer is valid until the next
+ * call to group_add().
+ */
+const struct Group_Chat *group_get(uint32_t groupnum);
+
+/*
+ * Records the peer count of groupnum. Does nothing if groupnum isn't registered.
+ *
+ * A group with one peer or less (just us) is put on the expiry queue, and taken off it again when
+ * someone joins. Newly registered groups start out on the queue.
+ */
+void group_set_peer_count(uint32_t groupnum, uint32_t num_peers);
+
+/*
+ * Takes the group that has been empty the longest off the expiry queue and returns its groupnum,
+ * if it has been empty for at least `grace` seconds as of `cur_time`. Returns -1 otherwise.
+ *
+ * The group stays registered; the caller is expected to leave it.
+ */
+int64_t group_pop_expired(time_t cur_time, uint64_t grace);
+
+/*
+ * Returns the null terminated title of groupnum and sets `length` to its length, or returns NULL if
+ * groupnum isn't registered. The pointer is valid until the next call to group_add().
+ */
+const char *group_get_title(uint32_t groupnum, size_t *length);
+
+/* Sets the title of groupnum, truncating it to fit. Does nothing if groupnum isn't registered. */
+void group_set_title(uint32_t groupnum, const char *title, size_t length);
+
+/*
+ * Sets the password of groupnum, or removes it if `password` is NULL.
+ *
+ * Returns 0 on success.
+ * Returns -1 if groupnum isn't registered or the password is MAX_PASSWORD_SIZE chars or longer.
+ */
+int group_set_password(uint32_t groupnum, const char *password);
 
+/* Returns the null terminated password of groupnum, or NULL if it has none or isn't registered. */
+const char *group_get_password(uint32_t groupnum);
+
+/* Returns true if groupnum has no password or `password` matches it. `password` may be NULL. */
+bool group_check_password(uint32_t groupnum, const char *password);
+
+/* Returns the number of slots in the registry, for iterating over it with group_at(). */
+uint32_t groups_num_slots(void);
+
+/* Returns the record in slot `idx`, or NULL if the slot is free. */
+const struct Group_Chat *group_at(uint32_t idx);
+
+/* Returns the number of registered groups. */
+uint32_t groups_count(void);
+
+/* Frees the registry. */
+void groups_free(void);
+
+#endif  /* GROUPCHATS_H */
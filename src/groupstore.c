@@ -0,0 +1,243 @@
+/*  groupstore.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "groupstore.h"
+#include "misc.h"
+#include "saver.h"
+
+static const uint8_t no_group_id[TOX_CONFERENCE_ID_SIZE];
+
+int group_store_save(const Tox *m, const char *path, const struct Group_Store_Settings *settings)
+{
+    size_t size = sizeof(struct Group_Store_Header) + groups_count() * sizeof(struct Group_Store_Record);
+    uint8_t *data = calloc(1, size);
+
+    if (data == NULL) {
+        return -1;
+    }
+
+    struct Group_Store_Header header = {
+        .version = GROUP_STORE_VERSION,
+        .inactive_limit = settings->inactive_limit,
+    };
+
+    memcpy(header.magic, GROUP_STORE_MAGIC, sizeof(header.magic));
+
+    if (settings->default_groupnum >= 0 && group_get(settings->default_groupnum) != NULL) {
+        tox_conference_get_id(m, settings->default_groupnum, header.default_group_id);
+    }
+
+    struct Group_Store_Record *records = (struct Group_Store_Record *) (data + sizeof(header));
+
+    for (uint32_t i = 0; i < groups_num_slots(); ++i) {
+        const struct Group_Chat *chat = group_at(i);
+
+        if (chat == NULL) {
+            continue;
+        }
+
+        struct Group_Store_Record *rec = &records[header.num_groups];
+
+        if (!tox_conference_get_id(m, chat->groupnum, rec->id)) {
+            continue;
+        }
+
+        size_t title_len = 0;
+        const char *title = group_get_title(chat->groupnum, &title_len);
+        memcpy(rec->title, title, title_len);
+        rec->title_length = title_len;
+
+        const char *password = group_get_password(chat->groupnum);
+
+        if (password != NULL) {
+            rec->flags |= GROUP_STORE_HAS_PASS;
+            snprintf(rec->password, sizeof(rec->password), "%s", password);
+        }
+
+        ++header.num_groups;
+    }
+
+    memcpy(data, &header, sizeof(header));
+
+    size = sizeof(header) + header.num_groups * sizeof(struct Group_Store_Record);
+    int ret = saver_submit_data(path, data, size);
+
+    free(data);
+
+    return ret;
+}
+
+/* Returns true if the group in `rec` is registered and its metadata was restored. */
+static bool restore_group(const Tox *m, const struct Group_Store_Record *rec)
+{
+    Tox_Err_Conference_By_Id err;
+    uint32_t groupnum = tox_conference_by_id(m, rec->id, &err);
+
+    if (err != TOX_ERR_CONFERENCE_BY_ID_OK || group_get(groupnum) == NULL) {
+        return false;
+    }
+
+    if (rec->title_length > 0) {
+        group_set_title(groupnum, rec->title, MIN(rec->title_length, TOX_MAX_NAME_LENGTH));
+    }
+
+    if (rec->flags & GROUP_STORE_HAS_PASS) {
+        char password[MAX_PASSWORD_SIZE];
+        memcpy(password, rec->password, sizeof(password));
+        password[sizeof(password) - 1] = '\0';
+        group_set_password(groupnum, password);
+    }
+
+    return true;
+}
+
+/*
+ * Decrypts the `length` bytes at `data` with the saver's pass key into a new buffer, setting
+ * `plain_length` to its length. Returns NULL on failure.
+ */
+static uint8_t *decrypt_store(const char *path, const uint8_t *data, size_t length, size_t *plain_length)
+{
+    const Tox_Pass_Key *pass_key = saver_get_pass_key();
+
+    if (pass_key == NULL || length < TOX_PASS_ENCRYPTION_EXTRA_LENGTH) {
+        fprintf(stderr, "Warning: '%s' is encrypted but no passphrase was given\n", path);
+        return NULL;
+    }
+
+    *plain_length = length - TOX_PASS_ENCRYPTION_EXTRA_LENGTH;
+    uint8_t *plaintext = malloc(MAX(*plain_length, 1));
+
+    if (plaintext == NULL) {
+        return NULL;
+    }
+
+    Tox_Err_Decryption err;
+
+    if (!tox_pass_key_decrypt(pass_key, data, length, plaintext, &err)) {
+        fprintf(stderr, "Warning: failed to decrypt '%s' (error %d)\n", path, err);
+        free(plaintext);
+        return NULL;
+    }
+
+    return plaintext;
+}
+
+int group_store_load(const Tox *m, const char *path, struct Group_Store_Settings *settings)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat s;
+
+    /* also long enough for tox_is_data_encrypted() to check the magic */
+    if (fstat(fd, &s) != 0 || (size_t) s.st_size < sizeof(struct Group_Store_Header)) {
+        close(fd);
+        return -1;
+    }
+
+    size_t map_size = s.st_size;
+    uint8_t *map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    /* a plaintext store is read in place; an encrypted one has to be decrypted into a copy first */
+    const uint8_t *data = map;
+    size_t size = map_size;
+    uint8_t *plaintext = NULL;
+
+    if (tox_is_data_encrypted(map)) {
+        plaintext = decrypt_store(path, map, map_size, &size);
+        munmap(map, map_size);
+        map = NULL;
+
+        if (plaintext == NULL) {
+            return -1;
+        }
+
+        data = plaintext;
+    }
+
+    struct Group_Store_Header header;
+    int restored = -1;
+
+    if (size < sizeof(header)) {
+        goto out;
+    }
+
+    memcpy(&header, data, sizeof(header));
+
+    size_t records_size = size - sizeof(header);
+
+    if (memcmp(header.magic, GROUP_STORE_MAGIC, sizeof(header.magic)) != 0 || header.version != GROUP_STORE_VERSION
+            || records_size % sizeof(struct Group_Store_Record) != 0
+            || header.num_groups != records_size / sizeof(struct Group_Store_Record)
+            || header.inactive_limit == 0) {
+        goto out;
+    }
+
+    /* records are only byte arrays, so they can be read in place */
+    const struct Group_Store_Record *records = (const struct Group_Store_Record *) (data + sizeof(header));
+
+    restored = 0;
+
+    for (size_t i = 0; i < header.num_groups; ++i) {
+        if (restore_group(m, &records[i])) {
+            ++restored;
+        }
+    }
+
+    settings->inactive_limit = header.inactive_limit;
+
+    /* groupnums aren't stable across restarts, so a default group we've left is not carried over */
+    if (memcmp(header.default_group_id, no_group_id, sizeof(no_group_id)) != 0) {
+        Tox_Err_Conference_By_Id err;
+        uint32_t groupnum = tox_conference_by_id(m, header.default_group_id, &err);
+
+        if (err == TOX_ERR_CONFERENCE_BY_ID_OK) {
+            settings->default_groupnum = groupnum;
+        }
+    }
+
+out:
+
+    if (map != NULL) {
+        munmap(map, map_size);
+    }
+
+    free(plaintext);
+
+    return restored;
+}
@@ -0,0 +1,87 @@
+/*  groupstore.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef GROUPSTORE_H
+#define GROUPSTORE_H
+
+#include <stdint.h>
+#include <tox/tox.h>
+
+#include "groupchats.h"
+
+#define GROUP_STORE_MAGIC "TBGS"
+#define GROUP_STORE_VERSION 1
+
+#define GROUP_STORE_HAS_PASS (1 << 0)
+
+/*
+ * Group metadata that toxcore doesn't keep in the profile, along with bot-wide settings, so that
+ * they survive restarts.
+ *
+ * On-disk layout: this header followed by `num_groups` fixed-size records, the whole of which is
+ * encrypted with the profile's pass key if it has one. Groups are identified by their conference ID,
+ * as groupnums aren't stable across restarts. All fields are in host byte order.
+ */
+struct Group_Store_Header {
+    char     magic[4];
+    uint32_t version;
+    uint64_t num_groups;
+    uint64_t inactive_limit;
+    uint8_t  default_group_id[TOX_CONFERENCE_ID_SIZE];  // all zeroes if the default group isn't one we're in
+};
+
+struct Group_Store_Record {
+    uint8_t id[TOX_CONFERENCE_ID_SIZE];
+    uint8_t flags;
+    uint8_t title_length;
+    char    title[TOX_MAX_NAME_LENGTH];
+    char    password[MAX_PASSWORD_SIZE];  // null terminated
+};
+
+struct Group_Store_Settings {
+    int      default_groupnum;
+    uint64_t inactive_limit;
+};
+
+/*
+ * Builds a snapshot of the passwords, titles and flags of every registered group, and `settings`,
+ * and hands it to the saver thread, which atomically replaces the store at `path` with it. The store
+ * is encrypted like the profile if a passphrase was set.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int group_store_save(const Tox *m, const char *path, const struct Group_Store_Settings *settings);
+
+/*
+ * Memory-maps the store at `path`, decrypting it with the saver's pass key if it's encrypted, and
+ * restores the metadata of the registered groups in it, and `settings`. Groups we're no longer in are
+ * skipped. The default group is looked up by its conference ID, and `settings->default_groupnum` is
+ * only changed if we're still in it. `settings` is left untouched if the store doesn't exist or is
+ * invalid.
+ *
+ * Returns the number of groups restored.
+ * Returns -1 if the store doesn't exist or is invalid.
+ */
+int group_store_load(const Tox *m, const char *path, struct Group_Store_Settings *settings);
+
+#endif /* GROUPSTORE_H */
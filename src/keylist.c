@@ -0,0 +1,230 @@
+/*  keylist.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <tox/tox.h>
+
+#include "codec.h"
+#include "keylist.h"
+#include "log.h"
+#include "misc.h"
+
+/* The smallest number of keys a bloom filter is sized for */
+#define KEY_LIST_MIN_FILTER_KEYS 1024
+
+static struct Key_List *open_lists[MAX_KEY_LISTS];
+
+/* Decodes the public key at the start of `line`. Returns false if the line does not begin with a key. */
+static bool parse_key_line(const char *line, uint8_t *key)
+{
+    while (isspace((unsigned char) *line)) {
+        ++line;
+    }
+
+    if (strlen(line) < TOX_PUBLIC_KEY_SIZE * 2) {
+        return false;
+    }
+
+    return hex_decode(key, TOX_PUBLIC_KEY_SIZE, line) == 0;
+}
+
+static void filter_add_key(const uint8_t *public_key, void *userdata)
+{
+    bloom_add((struct Bloom_Filter *) userdata, public_key);
+}
+
+/* Rebuilds the bloom filter for `list` from scratch. The old filter is kept on allocation failure. */
+static void rebuild_filter(struct Key_List *list)
+{
+    struct Bloom_Filter filter;
+    size_t expected = MAX(key_store_count(&list->store), KEY_LIST_MIN_FILTER_KEYS);
+
+    uint64_t seed = ((uint64_t) get_time() << 32) ^ (uint64_t) getpid() ^ (uint64_t) (uintptr_t) list;
+
+    if (bloom_init(&filter, expected, seed) != 0) {
+        fprintf(stderr, "Warning: failed to build filter for '%s' (out of memory)\n", list->path);
+        return;
+    }
+
+    key_store_for_each(&list->store, filter_add_key, &filter);
+
+    bloom_free(&list->filter);
+    list->filter = filter;
+    list->filter_keys = expected;
+}
+
+/*
+ * Adds every key in the text file for `list` to its store, then renames the file so that it's never
+ * imported again; later edits to a stale copy would otherwise undo unmaster and unblock.
+ *
+ * Returns the number of keys that were not already in the store, or -1 if the file can't be read.
+ */
+static int import_text_file(struct Key_List *list)
+{
+    FILE *fp = fopen(list->path, "r");
+
+    if (fp == NULL) {
+        fprintf(stderr, "Warning: failed to read '%s' file\n", list->path);
+        return -1;
+    }
+
+    int added = 0;
+    char line[256];
+
+    while (fgets(line, sizeof(line), fp)) {
+        uint8_t key[TOX_PUBLIC_KEY_SIZE];
+
+        if (!parse_key_line(line, key)) {
+            continue;
+        }
+
+        if (key_list_add(list, key) == 1) {
+            ++added;
+        }
+    }
+
+    fclose(fp);
+
+    /* the file must not disappear before its keys are safely journaled */
+    if (key_store_flush(&list->store) != 0) {
+        fprintf(stderr, "Warning: failed to save keys imported from '%s'\n", list->path);
+        return added;
+    }
+
+    char imported_path[256];
+    snprintf(imported_path, sizeof(imported_path), "%s%s", list->path, KEY_LIST_IMPORTED_SUFFIX);
+
+    if (rename(list->path, imported_path) != 0) {
+        fprintf(stderr, "Warning: failed to rename '%s' to '%s'; it will be imported again on next start\n",
+                list->path, imported_path);
+    }
+
+    return added;
+}
+
+bool key_list_contains(const struct Key_List *list, const uint8_t *public_key)
+{
+    if (list->use_filter && list->filter.blocks != NULL && !bloom_contains(&list->filter, public_key)) {
+        return false;
+    }
+
+    return key_store_contains(&list->store, public_key);
+}
+
+size_t key_list_count(const struct Key_List *list)
+{
+    return key_store_count(&list->store);
+}
+
+int key_list_add(struct Key_List *list, const uint8_t *public_key)
+{
+    int ret = key_store_add(&list->store, public_key);
+
+    if (ret != 1 || !list->use_filter) {
+        return ret;
+    }
+
+    if (key_store_count(&list->store) > list->filter_keys * 2) {
+        rebuild_filter(list);
+    } else if (list->filter.blocks != NULL) {
+        bloom_add(&list->filter, public_key);
+    }
+
+    return ret;
+}
+
+int key_list_remove(struct Key_List *list, const uint8_t *public_key)
+{
+    /* the filter keeps the key's bits until it's next rebuilt, which only costs a false positive */
+    return key_store_remove(&list->store, public_key);
+}
+
+int key_list_init(struct Key_List *list, const char *path, const char *store_path, bool use_filter)
+{
+    *list = (struct Key_List) {
+        0
+    };
+
+    list->path = path;
+    list->use_filter = use_filter;
+
+    if (key_store_open(&list->store, store_path) != 0) {
+        fprintf(stderr, "Warning: failed to open key store '%s'\n", store_path);
+        return -1;
+    }
+
+    size_t i;
+
+    for (i = 0; i < MAX_KEY_LISTS; ++i) {
+        if (open_lists[i] == NULL) {
+            open_lists[i] = list;
+            break;
+        }
+    }
+
+    if (i == MAX_KEY_LISTS) {
+        fprintf(stderr, "Warning: '%s' will not be compacted (too many key lists)\n", store_path);
+    }
+
+    if (file_exists(path)) {
+        int added = import_text_file(list);
+
+        if (added >= 0) {
+            printf("Imported %d keys from '%s' into '%s'\n", added, path, store_path);
+        }
+    }
+
+    if (use_filter) {
+        rebuild_filter(list);
+    }
+
+    return 0;
+}
+
+void key_list_free(struct Key_List *list)
+{
+    for (size_t i = 0; i < MAX_KEY_LISTS; ++i) {
+        if (open_lists[i] == list) {
+            open_lists[i] = NULL;
+        }
+    }
+
+    key_store_close(&list->store);
+    bloom_free(&list->filter);
+}
+
+void key_list_poll(void)
+{
+    for (size_t i = 0; i < MAX_KEY_LISTS; ++i) {
+        struct Key_List *list = open_lists[i];
+
+        /* dropping keys removed since the last filter build once they're compacted away */
+        if (list != NULL && key_store_poll(&list->store) && list->use_filter) {
+            rebuild_filter(list);
+        }
+    }
+}
@@ -0,0 +1,98 @@
+/*  keylist.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef KEYLIST_H
+#define KEYLIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bloom.h"
+#include "keystore.h"
+
+/* Maximum number of key lists that may be open at once */
+#define MAX_KEY_LISTS 4
+
+/* Suffix a text file is renamed with once its keys have been imported */
+#define KEY_LIST_IMPORTED_SUFFIX ".imported"
+
+/*
+ * A set of public keys kept in a binary key store. A plain text file of keys (one hex encoded key or
+ * Tox ID per line) found on startup is converted into the store once and then renamed, so that the
+ * store is the only source of truth afterwards.
+ */
+struct Key_List {
+    const char      *path;    // text file keys are imported from
+    struct Key_Store store;
+
+    bool                use_filter;    // true if lookups are prefiltered with a bloom filter
+    struct Bloom_Filter filter;
+    size_t              filter_keys;   // number of keys the filter was sized for
+};
+
+/*
+ * Initializes `list`, opening the key store at `store_path`. If the text file at `path` exists its
+ * keys are added to the store and it's renamed to `path` KEY_LIST_IMPORTED_SUFFIX.
+ *
+ * If `use_filter` is true, lookups first consult a bloom filter built from the list. This makes
+ * rejecting keys that aren't in a large list cost a single cache line.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int key_list_init(struct Key_List *list, const char *path, const char *store_path, bool use_filter);
+
+/* Frees all memory associated with `list`. */
+void key_list_free(struct Key_List *list);
+
+/* Returns true if `public_key` is in `list`. */
+bool key_list_contains(const struct Key_List *list, const uint8_t *public_key);
+
+/* Returns the number of keys in `list`. */
+size_t key_list_count(const struct Key_List *list);
+
+/*
+ * Adds `public_key` to `list`.
+ *
+ * Returns 1 if the key was added.
+ * Returns 0 if the key was already in the list.
+ * Returns -1 on failure.
+ */
+int key_list_add(struct Key_List *list, const uint8_t *public_key);
+
+/*
+ * Removes `public_key` from `list`.
+ *
+ * Returns 1 if the key was removed.
+ * Returns 0 if the key was not in the list.
+ * Returns -1 on failure.
+ */
+int key_list_remove(struct Key_List *list, const uint8_t *public_key);
+
+/*
+ * Does housekeeping on the key stores of all open lists. This should be called once per main loop
+ * iteration; it is the only place a key list touches the file system outside of edits.
+ */
+void key_list_poll(void);
+
+#endif /* KEYLIST_H */
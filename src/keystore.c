@@ -0,0 +1,857 @@
+/*  keystore.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <tox/tox.h>
+
+#include "keystore.h"
+#include "log.h"
+#include "misc.h"
+
+/* A compaction starts once this many edits are pending, or an eighth of the store, whichever is larger */
+#define KEY_STORE_COMPACT_MIN_EDITS 1024
+
+#define KEY_DELTA_MIN_CAPACITY 64
+
+/* The sorted array is indexed by up to this many leading key bits, and on average at least this many keys per bucket */
+#define KEY_INDEX_MAX_BITS 16
+#define KEY_INDEX_MIN_BUCKET 4
+
+#define JOURNAL_OP_ADD    '+'
+#define JOURNAL_OP_REMOVE '-'
+
+enum {
+    KEY_DELTA_EMPTY = 0,
+    KEY_DELTA_ADDED,
+    KEY_DELTA_REMOVED,
+};
+
+static uint64_t hash_seed;
+
+static uint64_t hash_key(const uint8_t *key)
+{
+    uint64_t a;
+    uint64_t b;
+    memcpy(&a, key, sizeof(a));
+    memcpy(&b, key + sizeof(a), sizeof(b));
+
+    /* splitmix64 finalizer; the seed keeps crafted keys from piling into one probe chain */
+    uint64_t h = a ^ (b * 0x9E3779B97F4A7C15ULL) ^ hash_seed;
+    h ^= h >> 30;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 27;
+    h *= 0x94D049BB133111EBULL;
+    h ^= h >> 31;
+
+    return h;
+}
+
+static int delta_init(struct Key_Delta *delta, size_t capacity)
+{
+    *delta = (struct Key_Delta) {
+        0
+    };
+
+    if (capacity == 0) {
+        return 0;
+    }
+
+    delta->keys = malloc(capacity * TOX_PUBLIC_KEY_SIZE);
+    delta->state = calloc(capacity, 1);
+
+    if (delta->keys == NULL || delta->state == NULL) {
+        free(delta->keys);
+        free(delta->state);
+        delta->keys = NULL;
+        delta->state = NULL;
+        return -1;
+    }
+
+    delta->capacity = capacity;
+
+    return 0;
+}
+
+static void delta_free(struct Key_Delta *delta)
+{
+    free(delta->keys);
+    free(delta->state);
+
+    *delta = (struct Key_Delta) {
+        0
+    };
+}
+
+/* Returns the slot holding `key`, or the empty slot it would be inserted into. */
+static size_t delta_slot(const struct Key_Delta *delta, const uint8_t *key)
+{
+    size_t mask = delta->capacity - 1;
+    size_t i = hash_key(key) & mask;
+
+    while (delta->state[i] != KEY_DELTA_EMPTY) {
+        if (memcmp(&delta->keys[i * TOX_PUBLIC_KEY_SIZE], key, TOX_PUBLIC_KEY_SIZE) == 0) {
+            break;
+        }
+
+        i = (i + 1) & mask;
+    }
+
+    return i;
+}
+
+static uint8_t delta_get(const struct Key_Delta *delta, const uint8_t *key)
+{
+    if (delta->count == 0) {
+        return KEY_DELTA_EMPTY;
+    }
+
+    return delta->state[delta_slot(delta, key)];
+}
+
+static int delta_set(struct Key_Delta *delta, const uint8_t *key, uint8_t state)
+{
+    /* keep the load factor at or below 1/2 so probe chains stay short */
+    if ((delta->count + 1) * 2 > delta->capacity) {
+        struct Key_Delta grown;
+
+        if (delta_init(&grown, MAX(delta->capacity * 2, KEY_DELTA_MIN_CAPACITY)) != 0) {
+            return -1;
+        }
+
+        for (size_t i = 0; i < delta->capacity; ++i) {
+            if (delta->state[i] != KEY_DELTA_EMPTY) {
+                size_t slot = delta_slot(&grown, &delta->keys[i * TOX_PUBLIC_KEY_SIZE]);
+                memcpy(&grown.keys[slot * TOX_PUBLIC_KEY_SIZE], &delta->keys[i * TOX_PUBLIC_KEY_SIZE], TOX_PUBLIC_KEY_SIZE);
+                grown.state[slot] = delta->state[i];
+                ++grown.count;
+            }
+        }
+
+        delta_free(delta);
+        *delta = grown;
+    }
+
+    size_t slot = delta_slot(delta, key);
+
+    if (delta->state[slot] == KEY_DELTA_EMPTY) {
+        memcpy(&delta->keys[slot * TOX_PUBLIC_KEY_SIZE], key, TOX_PUBLIC_KEY_SIZE);
+        ++delta->count;
+    }
+
+    delta->state[slot] = state;
+
+    return 0;
+}
+
+static uint32_t key_prefix(const uint8_t *key, unsigned int bits)
+{
+    return (((uint32_t) key[0] << 8) | key[1]) >> (16 - bits);
+}
+
+/*
+ * Builds the prefix index over the sorted array, which narrows each binary search down to a few
+ * adjacent keys. Returns -1 on allocation failure.
+ */
+static int build_index(const uint8_t *keys, size_t num_keys, uint32_t **index, unsigned int *index_bits)
+{
+    unsigned int bits = 0;
+
+    while (bits < KEY_INDEX_MAX_BITS && ((size_t) 2 << bits) * KEY_INDEX_MIN_BUCKET <= num_keys) {
+        ++bits;
+    }
+
+    size_t num_buckets = (size_t) 1 << bits;
+    uint32_t *idx = malloc((num_buckets + 1) * sizeof(uint32_t));
+
+    if (idx == NULL) {
+        return -1;
+    }
+
+    size_t pos = 0;
+
+    for (size_t p = 0; p < num_buckets; ++p) {
+        while (pos < num_keys && key_prefix(&keys[pos * TOX_PUBLIC_KEY_SIZE], bits) < p) {
+            ++pos;
+        }
+
+        idx[p] = pos;
+    }
+
+    idx[num_buckets] = num_keys;
+
+    *index = idx;
+    *index_bits = bits;
+
+    return 0;
+}
+
+static bool base_contains(const struct Key_Store *ks, const uint8_t *key)
+{
+    if (ks->num_keys == 0) {
+        return false;
+    }
+
+    uint32_t p = key_prefix(key, ks->index_bits);
+    size_t lo = ks->index[p];
+    size_t hi = ks->index[p + 1];
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(&ks->keys[mid * TOX_PUBLIC_KEY_SIZE], key, TOX_PUBLIC_KEY_SIZE);
+
+        if (cmp == 0) {
+            return true;
+        }
+
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return false;
+}
+
+size_t key_store_count(const struct Key_Store *ks)
+{
+    return ks->count;
+}
+
+bool key_store_contains(const struct Key_Store *ks, const uint8_t *public_key)
+{
+    uint8_t state = delta_get(&ks->pending, public_key);
+
+    if (state == KEY_DELTA_EMPTY) {
+        state = delta_get(&ks->compacting, public_key);
+    }
+
+    if (state != KEY_DELTA_EMPTY) {
+        return state == KEY_DELTA_ADDED;
+    }
+
+    return base_contains(ks, public_key);
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    return memcmp(*(const uint8_t *const *) a, *(const uint8_t *const *) b, TOX_PUBLIC_KEY_SIZE);
+}
+
+/*
+ * Writes the union of the sorted array `base` and the edits in `delta` to a new store at `path`.
+ * The file is written to a temporary path, synced and then renamed over `path`.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+static int write_store(const char *path, const uint8_t *base, size_t num_base, const struct Key_Delta *delta)
+{
+    const uint8_t **edits = NULL;
+    size_t num_edits = 0;
+
+    if (delta != NULL && delta->count > 0) {
+        edits = malloc(delta->count * sizeof(uint8_t *));
+
+        if (edits == NULL) {
+            return -1;
+        }
+
+        for (size_t i = 0; i < delta->capacity; ++i) {
+            if (delta->state[i] != KEY_DELTA_EMPTY) {
+                edits[num_edits++] = &delta->keys[i * TOX_PUBLIC_KEY_SIZE];
+            }
+        }
+
+        qsort(edits, num_edits, sizeof(uint8_t *), compare_keys);
+    }
+
+    char tmp_path[KEY_STORE_PATH_SIZE + 16];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp_path, "wb");
+
+    if (fp == NULL) {
+        free(edits);
+        return -1;
+    }
+
+    struct Key_Store_Header header = {
+        .version = KEY_STORE_VERSION,
+    };
+
+    memcpy(header.magic, KEY_STORE_MAGIC, sizeof(header.magic));
+
+    if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+        goto on_error;
+    }
+
+    size_t i = 0;
+    size_t j = 0;
+
+    while (i < num_base || j < num_edits) {
+        const uint8_t *base_key = i < num_base ? &base[i * TOX_PUBLIC_KEY_SIZE] : NULL;
+        int cmp = base_key == NULL ? 1 : j == num_edits ? -1 : memcmp(base_key, edits[j], TOX_PUBLIC_KEY_SIZE);
+
+        if (cmp < 0) {
+            if (fwrite(base_key, TOX_PUBLIC_KEY_SIZE, 1, fp) != 1) {
+                goto on_error;
+            }
+
+            ++header.num_keys;
+            ++i;
+            continue;
+        }
+
+        /* an edit overrides the base copy of the same key */
+        size_t slot = (size_t) (edits[j] - delta->keys) / TOX_PUBLIC_KEY_SIZE;
+
+        if (delta->state[slot] == KEY_DELTA_ADDED) {
+            if (fwrite(edits[j], TOX_PUBLIC_KEY_SIZE, 1, fp) != 1) {
+                goto on_error;
+            }
+
+            ++header.num_keys;
+        }
+
+        if (cmp == 0) {
+            ++i;
+        }
+
+        ++j;
+    }
+
+    if (fseek(fp, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, fp) != 1) {
+        goto on_error;
+    }
+
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        goto on_error;
+    }
+
+    fclose(fp);
+    free(edits);
+
+    return rename(tmp_path, path) == 0 ? 0 : -1;
+
+on_error:
+    fclose(fp);
+    unlink(tmp_path);
+    free(edits);
+    return -1;
+}
+
+/* Memory-maps the store file and validates it. The previous mapping is only replaced on success. */
+static int map_store(struct Key_Store *ks)
+{
+    int fd = open(ks->path, O_RDONLY);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat s;
+
+    if (fstat(fd, &s) != 0 || (size_t) s.st_size < sizeof(struct Key_Store_Header)) {
+        close(fd);
+        return -1;
+    }
+
+    size_t map_size = s.st_size;
+    uint8_t *map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    struct Key_Store_Header header;
+    memcpy(&header, map, sizeof(header));
+
+    const uint8_t *keys = map + sizeof(header);
+
+    if (memcmp(header.magic, KEY_STORE_MAGIC, sizeof(header.magic)) != 0 || header.version != KEY_STORE_VERSION
+            || header.num_keys != (map_size - sizeof(header)) / TOX_PUBLIC_KEY_SIZE
+            || (map_size - sizeof(header)) % TOX_PUBLIC_KEY_SIZE != 0) {
+        munmap(map, map_size);
+        return -1;
+    }
+
+    for (size_t i = 1; i < header.num_keys; ++i) {
+        if (memcmp(&keys[(i - 1) * TOX_PUBLIC_KEY_SIZE], &keys[i * TOX_PUBLIC_KEY_SIZE], TOX_PUBLIC_KEY_SIZE) >= 0) {
+            munmap(map, map_size);
+            return -1;
+        }
+    }
+
+    uint32_t *index;
+    unsigned int index_bits;
+
+    if (build_index(keys, header.num_keys, &index, &index_bits) != 0) {
+        munmap(map, map_size);
+        return -1;
+    }
+
+    if (ks->map != NULL) {
+        munmap(ks->map, ks->map_size);
+    }
+
+    free(ks->index);
+
+    ks->map = map;
+    ks->map_size = map_size;
+    ks->keys = keys;
+    ks->num_keys = header.num_keys;
+    ks->index = index;
+    ks->index_bits = index_bits;
+
+    return 0;
+}
+
+/* Records an edit in the pending delta without journaling it. `present` is whether the key is currently in the set. */
+static int apply_edit(struct Key_Store *ks, char op, const uint8_t *public_key, bool present)
+{
+    if ((op == JOURNAL_OP_ADD) == present) {
+        return 0;
+    }
+
+    uint8_t state = op == JOURNAL_OP_ADD ? KEY_DELTA_ADDED : KEY_DELTA_REMOVED;
+
+    if (delta_set(&ks->pending, public_key, state) != 0) {
+        return -1;
+    }
+
+    if (op == JOURNAL_OP_ADD) {
+        ++ks->count;
+    } else {
+        --ks->count;
+    }
+
+    return 1;
+}
+
+static int journal_append(struct Key_Store *ks, char op, const uint8_t *public_key)
+{
+    if (ks->journal == NULL) {
+        return -1;
+    }
+
+    if (fputc(op, ks->journal) == EOF || fwrite(public_key, TOX_PUBLIC_KEY_SIZE, 1, ks->journal) != 1) {
+        return -1;
+    }
+
+    ks->journal_dirty = true;
+
+    return 0;
+}
+
+/* Returns the number of records replayed from the journal at `path`, or 0 if it doesn't exist. */
+static size_t replay_journal(struct Key_Store *ks, const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL) {
+        return 0;
+    }
+
+    size_t replayed = 0;
+    uint8_t record[1 + TOX_PUBLIC_KEY_SIZE];
+
+    /* a torn record at the end of the journal is simply dropped */
+    while (fread(record, sizeof(record), 1, fp) == 1) {
+        if (record[0] != JOURNAL_OP_ADD && record[0] != JOURNAL_OP_REMOVE) {
+            fprintf(stderr, "Warning: ignoring corrupt record in '%s'\n", path);
+            break;
+        }
+
+        apply_edit(ks, record[0], record + 1, key_store_contains(ks, record + 1));
+        ++replayed;
+    }
+
+    fclose(fp);
+
+    return replayed;
+}
+
+static int journal_open(struct Key_Store *ks)
+{
+    ks->journal = fopen(ks->journal_path, "ab");
+
+    if (ks->journal == NULL) {
+        fprintf(stderr, "Warning: failed to open '%s'\n", ks->journal_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void journal_close(struct Key_Store *ks)
+{
+    if (ks->journal != NULL) {
+        fclose(ks->journal);
+        ks->journal = NULL;
+    }
+
+    ks->journal_dirty = false;
+}
+
+/*
+ * Folds the journal into the old journal left behind by an unfinished compaction so that a single
+ * journal holds every edit not yet in the store file, oldest first.
+ */
+static int journal_merge_old(struct Key_Store *ks)
+{
+    if (!file_exists(ks->old_journal_path)) {
+        return 0;
+    }
+
+    journal_close(ks);
+
+    FILE *dst = fopen(ks->old_journal_path, "ab");
+    FILE *src = fopen(ks->journal_path, "rb");
+
+    if (dst == NULL) {
+        if (src != NULL) {
+            fclose(src);
+        }
+
+        return -1;
+    }
+
+    int ret = 0;
+
+    if (src != NULL) {
+        char buf[4096];
+        size_t len;
+
+        while ((len = fread(buf, 1, sizeof(buf), src)) > 0) {
+            if (fwrite(buf, 1, len, dst) != len) {
+                ret = -1;
+                break;
+            }
+        }
+
+        fclose(src);
+    }
+
+    if (fclose(dst) != 0) {
+        ret = -1;
+    }
+
+    if (ret == 0 && rename(ks->old_journal_path, ks->journal_path) != 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/* Moves the entries of the compacting delta that haven't since been edited again back into the pending delta. */
+static int restore_compacting(struct Key_Store *ks)
+{
+    struct Key_Delta *old = &ks->compacting;
+
+    for (size_t i = 0; i < old->capacity; ++i) {
+        const uint8_t *key = &old->keys[i * TOX_PUBLIC_KEY_SIZE];
+
+        if (old->state[i] == KEY_DELTA_EMPTY || delta_get(&ks->pending, key) != KEY_DELTA_EMPTY) {
+            continue;
+        }
+
+        if (delta_set(&ks->pending, key, old->state[i]) != 0) {
+            return -1;
+        }
+    }
+
+    delta_free(old);
+
+    return 0;
+}
+
+static void *compaction_thread(void *arg)
+{
+    struct Key_Store *ks = arg;
+
+    int ret = write_store(ks->path, ks->keys, ks->num_keys, &ks->compacting);
+
+    atomic_store(&ks->compaction.status, ret);
+
+    return NULL;
+}
+
+/*
+ * Freezes the pending edits and starts merging them into a new store file in the background.
+ * The live journal is rotated so that edits made during the compaction are kept separately.
+ */
+static int start_compaction(struct Key_Store *ks)
+{
+    struct Key_Delta fresh;
+
+    if (delta_init(&fresh, KEY_DELTA_MIN_CAPACITY) != 0) {
+        return -1;
+    }
+
+    journal_close(ks);
+
+    if (rename(ks->journal_path, ks->old_journal_path) != 0) {
+        delta_free(&fresh);
+        journal_open(ks);
+        return -1;
+    }
+
+    journal_open(ks);
+
+    ks->compacting = ks->pending;
+    ks->pending = fresh;
+    atomic_store(&ks->compaction.status, 1);
+
+    if (pthread_create(&ks->compaction.thread, NULL, compaction_thread, ks) != 0) {
+        restore_compacting(ks);
+        journal_merge_old(ks);
+        journal_open(ks);
+        return -1;
+    }
+
+    ks->compaction.running = true;
+
+    return 0;
+}
+
+static int finish_compaction(struct Key_Store *ks)
+{
+    pthread_join(ks->compaction.thread, NULL);
+    ks->compaction.running = false;
+
+    if (atomic_load(&ks->compaction.status) != 0) {
+        log_error_timestamp(-1, "Failed to compact key store '%s'", ks->path);
+        restore_compacting(ks);
+        journal_merge_old(ks);
+
+        if (ks->journal == NULL) {
+            journal_open(ks);
+        }
+
+        return -1;
+    }
+
+    unlink(ks->old_journal_path);
+
+    if (map_store(ks) != 0) {
+        /* The new file has every edit, but until we manage to map it the old mapping plus the edits stays authoritative */
+        log_error_timestamp(-1, "Failed to map compacted key store '%s'", ks->path);
+        restore_compacting(ks);
+        return -1;
+    }
+
+    delta_free(&ks->compacting);
+
+    return 0;
+}
+
+int key_store_flush(struct Key_Store *ks)
+{
+    if (ks->journal == NULL) {
+        return -1;
+    }
+
+    if (fflush(ks->journal) != 0 || fsync(fileno(ks->journal)) != 0) {
+        return -1;
+    }
+
+    ks->journal_dirty = false;
+
+    return 0;
+}
+
+bool key_store_poll(struct Key_Store *ks)
+{
+    if (ks->journal_dirty) {
+        fflush(ks->journal);
+        ks->journal_dirty = false;
+    }
+
+    if (ks->compaction.running) {
+        if (atomic_load(&ks->compaction.status) == 1) {
+            return false;
+        }
+
+        return finish_compaction(ks) == 0;
+    }
+
+    if (ks->pending.count >= MAX(KEY_STORE_COMPACT_MIN_EDITS, ks->num_keys / 8)) {
+        start_compaction(ks);
+    }
+
+    return false;
+}
+
+int key_store_add(struct Key_Store *ks, const uint8_t *public_key)
+{
+    if (key_store_contains(ks, public_key)) {
+        return 0;
+    }
+
+    if (journal_append(ks, JOURNAL_OP_ADD, public_key) != 0) {
+        return -1;
+    }
+
+    return apply_edit(ks, JOURNAL_OP_ADD, public_key, false);
+}
+
+int key_store_remove(struct Key_Store *ks, const uint8_t *public_key)
+{
+    if (!key_store_contains(ks, public_key)) {
+        return 0;
+    }
+
+    if (journal_append(ks, JOURNAL_OP_REMOVE, public_key) != 0) {
+        return -1;
+    }
+
+    return apply_edit(ks, JOURNAL_OP_REMOVE, public_key, true);
+}
+
+void key_store_for_each(const struct Key_Store *ks, void (*callback)(const uint8_t *public_key, void *userdata),
+                        void *userdata)
+{
+    /* Each live key is reported from the newest place that mentions it */
+    for (size_t i = 0; i < ks->num_keys; ++i) {
+        const uint8_t *key = &ks->keys[i * TOX_PUBLIC_KEY_SIZE];
+
+        if (delta_get(&ks->pending, key) == KEY_DELTA_EMPTY && delta_get(&ks->compacting, key) == KEY_DELTA_EMPTY) {
+            callback(key, userdata);
+        }
+    }
+
+    for (size_t i = 0; i < ks->compacting.capacity; ++i) {
+        const uint8_t *key = &ks->compacting.keys[i * TOX_PUBLIC_KEY_SIZE];
+
+        if (ks->compacting.state[i] == KEY_DELTA_ADDED && delta_get(&ks->pending, key) == KEY_DELTA_EMPTY) {
+            callback(key, userdata);
+        }
+    }
+
+    for (size_t i = 0; i < ks->pending.capacity; ++i) {
+        if (ks->pending.state[i] == KEY_DELTA_ADDED) {
+            callback(&ks->pending.keys[i * TOX_PUBLIC_KEY_SIZE], userdata);
+        }
+    }
+}
+
+int key_store_open(struct Key_Store *ks, const char *path)
+{
+    if (hash_seed == 0) {
+        hash_seed = ((uint64_t) get_time() << 32) ^ (uint64_t) getpid() ^ (uint64_t) (uintptr_t) &hash_seed;
+    }
+
+    *ks = (struct Key_Store) {
+        0
+    };
+
+    snprintf(ks->path, sizeof(ks->path), "%s", path);
+    snprintf(ks->journal_path, sizeof(ks->journal_path), "%s.journal", path);
+    snprintf(ks->old_journal_path, sizeof(ks->old_journal_path), "%s.journal.old", path);
+
+    if (delta_init(&ks->pending, KEY_DELTA_MIN_CAPACITY) != 0) {
+        return -1;
+    }
+
+    if (!file_exists(ks->path) && write_store(ks->path, NULL, 0, NULL) != 0) {
+        fprintf(stderr, "Warning: failed to create key store '%s'\n", ks->path);
+        goto on_error;
+    }
+
+    if (map_store(ks) != 0) {
+        char corrupt_path[KEY_STORE_PATH_SIZE + 16];
+        snprintf(corrupt_path, sizeof(corrupt_path), "%s.corrupt", path);
+
+        fprintf(stderr, "Warning: key store '%s' is corrupt; moving it to '%s'\n", ks->path, corrupt_path);
+
+        if (rename(ks->path, corrupt_path) != 0 || write_store(ks->path, NULL, 0, NULL) != 0
+                || map_store(ks) != 0) {
+            goto on_error;
+        }
+    }
+
+    ks->count = ks->num_keys;
+
+    /* Edits left over from the last run are merged into the store straight away so we start with a clean journal */
+    size_t replayed = replay_journal(ks, ks->old_journal_path) + replay_journal(ks, ks->journal_path);
+
+    if (replayed > 0) {
+        if (write_store(ks->path, ks->keys, ks->num_keys, &ks->pending) == 0
+                && map_store(ks) == 0) {
+            unlink(ks->old_journal_path);
+            unlink(ks->journal_path);
+            delta_free(&ks->pending);
+            delta_init(&ks->pending, KEY_DELTA_MIN_CAPACITY);
+        } else if (journal_merge_old(ks) != 0) {
+            fprintf(stderr, "Warning: failed to recover journal for key store '%s'\n", ks->path);
+        }
+    }
+
+    if (journal_open(ks) != 0) {
+        goto on_error;
+    }
+
+    return 0;
+
+on_error:
+    delta_free(&ks->pending);
+    free(ks->index);
+    ks->index = NULL;
+
+    if (ks->map != NULL) {
+        munmap(ks->map, ks->map_size);
+        ks->map = NULL;
+    }
+
+    return -1;
+}
+
+void key_store_close(struct Key_Store *ks)
+{
+    if (ks->compaction.running) {
+        pthread_join(ks->compaction.thread, NULL);
+        ks->compaction.running = false;
+
+        if (atomic_load(&ks->compaction.status) == 0) {
+            unlink(ks->old_journal_path);
+        }
+    }
+
+    journal_close(ks);
+    delta_free(&ks->pending);
+    delta_free(&ks->compacting);
+    free(ks->index);
+    ks->index = NULL;
+
+    if (ks->map != NULL) {
+        munmap(ks->map, ks->map_size);
+        ks->map = NULL;
+    }
+}
@@ -0,0 +1,143 @@
+/*  keystore.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef KEYSTORE_H
+#define KEYSTORE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define KEY_STORE_MAGIC "TBKS"
+#define KEY_STORE_VERSION 1
+#define KEY_STORE_PATH_SIZE 256
+
+/*
+ * On-disk layout of a key store: this header followed by `num_keys` public keys sorted with memcmp().
+ * All fields are in host byte order.
+ */
+struct Key_Store_Header {
+    char     magic[4];
+    uint32_t version;
+    uint64_t num_keys;
+};
+
+/* Open addressing table of keys that were added or removed since the sorted file was written */
+struct Key_Delta {
+    uint8_t *keys;
+    uint8_t *state;
+    size_t   capacity;
+    size_t   count;
+};
+
+struct Key_Compaction {
+    pthread_t  thread;
+    bool       running;
+    atomic_int status;   // 1 while running, then 0 on success or -1 on failure
+};
+
+/*
+ * A set of public keys stored as a memory-mapped sorted array plus an append-only journal of edits.
+ * The journal is periodically merged into a new sorted file by a background thread.
+ */
+struct Key_Store {
+    char path[KEY_STORE_PATH_SIZE];
+    char journal_path[KEY_STORE_PATH_SIZE + 16];
+    char old_journal_path[KEY_STORE_PATH_SIZE + 16];
+
+    uint8_t       *map;
+    size_t         map_size;
+    const uint8_t *keys;       // points into map
+    size_t         num_keys;   // number of keys in the sorted array
+    uint32_t      *index;      // index[p] is the position of the first key whose leading index_bits bits are >= p
+    unsigned int   index_bits;
+
+    struct Key_Delta pending;     // edits journaled since the last compaction began
+    struct Key_Delta compacting;  // edits being merged into the sorted array
+
+    FILE  *journal;
+    bool   journal_dirty;
+    size_t count;   // number of keys in the set
+
+    struct Key_Compaction compaction;
+};
+
+/*
+ * Opens the key store at `path`, creating an empty one if it doesn't exist, and replays any
+ * journaled edits left over from a previous run.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int key_store_open(struct Key_Store *ks, const char *path);
+
+/* Flushes the journal, waits for any running compaction and frees all memory associated with `ks`. */
+void key_store_close(struct Key_Store *ks);
+
+/* Returns the number of keys in `ks`. */
+size_t key_store_count(const struct Key_Store *ks);
+
+/* Returns true if `public_key` is in `ks`. */
+bool key_store_contains(const struct Key_Store *ks, const uint8_t *public_key);
+
+/*
+ * Adds `public_key` to `ks`.
+ *
+ * Returns 1 if the key was added.
+ * Returns 0 if the key was already in the store.
+ * Returns -1 on failure.
+ */
+int key_store_add(struct Key_Store *ks, const uint8_t *public_key);
+
+/*
+ * Removes `public_key` from `ks`.
+ *
+ * Returns 1 if the key was removed.
+ * Returns 0 if the key was not in the store.
+ * Returns -1 on failure.
+ */
+int key_store_remove(struct Key_Store *ks, const uint8_t *public_key);
+
+/* Calls `callback` for every key in `ks`. */
+void key_store_for_each(const struct Key_Store *ks, void (*callback)(const uint8_t *public_key, void *userdata),
+                        void *userdata);
+
+/*
+ * Writes journaled edits through to disk, blocking until they're synced.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int key_store_flush(struct Key_Store *ks);
+
+/*
+ * Flushes journaled edits, starts a background compaction once enough edits have accumulated, and
+ * installs the new sorted file when a compaction finishes. This should be called once per main loop iteration.
+ *
+ * Returns true if a compaction finished during this call.
+ */
+bool key_store_poll(struct Key_Store *ks);
+
+#endif /* KEYSTORE_H */
@@ -28,12 +28,11 @@
 #define TIMESTAMP_SIZE 64
 #define MAX_MESSAGE_SIZE 512
 
-static struct tm *get_wall_time(void)
+/* Uses localtime_r() as messages may be logged from the saver thread */
+static struct tm *get_wall_time(struct tm *timeinfo)
 {
-    struct tm *timeinfo;
     time_t t = get_time();
-    timeinfo = localtime((const time_t *) &t);
-    return timeinfo;
+    return localtime_r(&t, timeinfo);
 }
 
 void log_timestamp(const char *message, ...)
@@ -45,8 +44,9 @@ void log_timestamp(const char *message, ...)
     vsnprintf(format, sizeof(format), message, args);
     va_end(args);
 
+    struct tm timeinfo;
     char ts[TIMESTAMP_SIZE];
-    strftime(ts, TIMESTAMP_SIZE,"[%H:%M:%S]", get_wall_time());
+    strftime(ts, TIMESTAMP_SIZE,"[%H:%M:%S]", get_wall_time(&timeinfo));
 
     printf("%s %s\n", ts, format);
 }
@@ -60,8 +60,9 @@ void log_error_timestamp(int err, const char *message, ...)
     vsnprintf(format, sizeof(format), message, args);
     va_end(args);
 
+    struct tm timeinfo;
     char ts[TIMESTAMP_SIZE];
-    strftime(ts, TIMESTAMP_SIZE,"[%H:%M:%S]", get_wall_time());
+    strftime(ts, TIMESTAMP_SIZE,"[%H:%M:%S]", get_wall_time(&timeinfo));
 
     fprintf(stderr, "%s %s (error %d)\n", ts, format, err);
 }
@@ -20,11 +20,15 @@
  *
  */
 
+/* for clock_gettime() */
+#define _POSIX_C_SOURCE 200809L
+
 #include <sys/stat.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <tox/tox.h>
@@ -41,20 +45,11 @@ time_t get_time(void)
     return time(NULL);
 }
 
-char *hex_string_to_bin(const char *hex_string)
+uint64_t get_monotonic_time(void)
 {
-    size_t len = strlen(hex_string);
-    char *val = malloc(len);
-
-    if (val == NULL) {
-        exit(EXIT_FAILURE);
-    }
-
-    for (size_t i = 0; i < len; ++i, hex_string += 2) {
-        sscanf(hex_string, "%2hhx", &val[i]);
-    }
-
-    return val;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 off_t file_size(const char *path)
@@ -74,6 +69,15 @@ bool file_exists(const char *path)
     return stat(path, &s) == 0;
 }
 
+void secure_zero(void *buf, size_t length)
+{
+    volatile uint8_t *p = buf;
+
+    while (length-- > 0) {
+        *p++ = 0;
+    }
+}
+
 uint16_t copy_tox_str(char *msg, size_t size, const char *data, uint16_t length)
 {
     int len = MIN(length, size - 1);
@@ -103,63 +107,3 @@ void get_elapsed_time_str(char *buf, int bufsize, uint64_t secs)
 
     snprintf(buf, bufsize, "%lud %luh %lum", days, hours, minutes);
 }
-
-/*
- * Searches plain text file pointed to by path for lines that match public_key.
- *
- * Returns 1 if a match is found.
- * Returns 0 if a match is not found.
- * Returns -1 on file operation failure.
- *
- * public_key must be a binary representation of a Tox public key.
- */
-int file_contains_key(const char *public_key, const char *path)
-{
-    FILE *fp = NULL;
-
-    struct stat s;
-
-    if (stat(path, &s) != 0) {
-        FILE *fp = fopen(path, "w");
-
-        if (fp == NULL) {
-            fprintf(stderr, "Warning: failed to create '%s' file\n", path);
-            return -1;
-        }
-
-        fprintf(stderr, "Warning: creating new '%s' file. Did you lose the old one?\n", path);
-        fclose(fp);
-        return 0;
-    }
-
-    fp = fopen(path, "r");
-
-    if (fp == NULL) {
-        fprintf(stderr, "Warning: failed to read '%s' file\n", path);
-        return -1;
-    }
-
-    char id[256];
-
-    while (fgets(id, sizeof(id), fp)) {
-        int len = strlen(id);
-
-        if (--len < TOX_PUBLIC_KEY_SIZE) {
-            continue;
-        }
-
-        char *key_bin = hex_string_to_bin(id);
-
-        if (memcmp(key_bin, public_key, TOX_PUBLIC_KEY_SIZE) == 0) {
-            free(key_bin);
-            fclose(fp);
-            return 1;
-        }
-
-        free(key_bin);
-    }
-
-    fclose(fp);
-    return 0;
-}
-
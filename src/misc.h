@@ -41,8 +41,8 @@ bool timed_out(time_t timestamp, time_t curtime, uint64_t timeout);
 /* Returns current unix timestamp */
 time_t get_time(void);
 
-/* converts hexidecimal string to binary */
-char *hex_string_to_bin(const char *hex_string);
+/* Returns a monotonic timestamp in microseconds, for measuring durations */
+uint64_t get_monotonic_time(void);
 
 /* returns file size or 0 on error */
 off_t file_size(const char *path);
@@ -50,6 +50,9 @@ off_t file_size(const char *path);
 /* Return true if a file exists at `path`. */
 bool file_exists(const char *path);
 
+/* Zeroes `length` bytes at `buf` in a way the compiler can't optimize away, for wiping secrets. */
+void secure_zero(void *buf, size_t length);
+
 /* copies data to msg buffer.
    returns length of msg, which will be no larger than size-1 */
 uint16_t copy_tox_str(char *msg, size_t size, const char *data, uint16_t length);
@@ -61,16 +64,4 @@ int char_find(int idx, const char *s, char ch);
 /* Converts seconds to string in format days hours minutes */
 void get_elapsed_time_str(char *buf, int bufsize, uint64_t secs);
 
-/*
- * Searches plain text file pointed to by path for lines that match public_key.
- *
- * Returns 1 if a match is found.
- * Returns 0 if a match is not found.
- * Returns -1 on file operation failure.
- *
- * public_key must be a binary representation of a Tox public key.
- */
-int file_contains_key(const char *public_key, const char *path);
-
 #endif /* MISC_H */
-
@@ -0,0 +1,261 @@
+/*  outbox.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "misc.h"
+#include "outbox.h"
+
+/* Maximum number of messages waiting for a single friend; any more are dropped */
+#define OUTBOX_QUEUE_SIZE 32
+
+#define MIN_INDEX_CAPACITY 64
+
+struct Outbox_Message {
+    uint16_t length;
+    uint8_t  data[TOX_MAX_MESSAGE_LENGTH];
+};
+
+/* A ring of messages waiting for one friend. It's allocated when the first message has to wait and freed once it drains. */
+struct Outbox_Queue {
+    uint32_t friendnumber;
+    size_t   head;
+    size_t   count;
+    struct Outbox_Message *ring;
+};
+
+/* Queues of friends that have messages waiting, in no particular order */
+static struct Outbox_Queue *queues;
+static size_t num_queues;
+static size_t queues_capacity;
+
+/* 1-based index into queues by friendnumber, or 0 if nothing is waiting for the friend */
+static uint32_t *queue_index;
+static uint32_t index_capacity;
+
+static size_t num_pending;
+static struct Outbox_Stats stats;
+
+static struct Outbox_Queue *find_queue(uint32_t friendnumber)
+{
+    if (friendnumber >= index_capacity || queue_index[friendnumber] == 0) {
+        return NULL;
+    }
+
+    return &queues[queue_index[friendnumber] - 1];
+}
+
+/* Returns a new empty queue for friendnumber. Returns NULL on allocation failure. */
+static struct Outbox_Queue *new_queue(uint32_t friendnumber)
+{
+    if (friendnumber >= index_capacity) {
+        uint32_t new_capacity = MAX(index_capacity, MIN_INDEX_CAPACITY);
+
+        while (new_capacity <= friendnumber) {
+            new_capacity *= 2;
+        }
+
+        uint32_t *tmp = realloc(queue_index, new_capacity * sizeof(uint32_t));
+
+        if (tmp == NULL) {
+            return NULL;
+        }
+
+        memset(&tmp[index_capacity], 0, (new_capacity - index_capacity) * sizeof(uint32_t));
+
+        queue_index = tmp;
+        index_capacity = new_capacity;
+    }
+
+    if (num_queues == queues_capacity) {
+        size_t new_capacity = MAX(queues_capacity * 2, 8);
+        struct Outbox_Queue *tmp = realloc(queues, new_capacity * sizeof(struct Outbox_Queue));
+
+        if (tmp == NULL) {
+            return NULL;
+        }
+
+        queues = tmp;
+        queues_capacity = new_capacity;
+    }
+
+    struct Outbox_Message *ring = malloc(OUTBOX_QUEUE_SIZE * sizeof(struct Outbox_Message));
+
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    struct Outbox_Queue *q = &queues[num_queues++];
+    q->friendnumber = friendnumber;
+    q->head = 0;
+    q->count = 0;
+    q->ring = ring;
+
+    queue_index[friendnumber] = num_queues;
+
+    return q;
+}
+
+/* Frees the queue at `idx`, dropping anything still in it. */
+static void remove_queue(size_t idx)
+{
+    struct Outbox_Queue *q = &queues[idx];
+
+    stats.dropped += q->count;
+    num_pending -= q->count;
+
+    queue_index[q->friendnumber] = 0;
+    free(q->ring);
+
+    if (idx != --num_queues) {
+        *q = queues[num_queues];
+        queue_index[q->friendnumber] = idx + 1;
+    }
+}
+
+static int enqueue(struct Outbox_Queue *q, const char *message, size_t length)
+{
+    if (q->count == OUTBOX_QUEUE_SIZE) {
+        ++stats.dropped;
+        return -1;
+    }
+
+    struct Outbox_Message *msg = &q->ring[(q->head + q->count) % OUTBOX_QUEUE_SIZE];
+    memcpy(msg->data, message, length);
+    msg->length = length;
+    ++q->count;
+
+    ++stats.deferred;
+    ++num_pending;
+    stats.peak = MAX(stats.peak, num_pending);
+
+    return 0;
+}
+
+int outbox_send(Tox *m, uint32_t friendnumber, const char *message, size_t length)
+{
+    length = MIN(length, TOX_MAX_MESSAGE_LENGTH);
+
+    if (length == 0) {
+        return 0;
+    }
+
+    struct Outbox_Queue *q = find_queue(friendnumber);
+
+    /* anything already waiting goes first */
+    if (q != NULL) {
+        return enqueue(q, message, length);
+    }
+
+    Tox_Err_Friend_Send_Message err;
+    tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (const uint8_t *) message, length, &err);
+
+    if (err == TOX_ERR_FRIEND_SEND_MESSAGE_OK) {
+        ++stats.sent;
+        return 0;
+    }
+
+    if (err != TOX_ERR_FRIEND_SEND_MESSAGE_SENDQ) {
+        ++stats.dropped;
+        return -1;
+    }
+
+    q = new_queue(friendnumber);
+
+    if (q == NULL) {
+        ++stats.dropped;
+        return -1;
+    }
+
+    return enqueue(q, message, length);
+}
+
+void outbox_process(Tox *m)
+{
+    /* walk backwards so that removing a drained queue doesn't skip the one moved into its place */
+    for (size_t i = num_queues; i-- > 0;) {
+        struct Outbox_Queue *q = &queues[i];
+
+        while (q->count > 0) {
+            const struct Outbox_Message *msg = &q->ring[q->head];
+
+            Tox_Err_Friend_Send_Message err;
+            tox_friend_send_message(m, q->friendnumber, TOX_MESSAGE_TYPE_NORMAL, msg->data, msg->length, &err);
+
+            if (err == TOX_ERR_FRIEND_SEND_MESSAGE_SENDQ) {
+                break;
+            }
+
+            if (err == TOX_ERR_FRIEND_SEND_MESSAGE_OK) {
+                ++stats.sent;
+            } else {
+                ++stats.dropped;
+            }
+
+            q->head = (q->head + 1) % OUTBOX_QUEUE_SIZE;
+            --q->count;
+            --num_pending;
+        }
+
+        if (q->count == 0) {
+            remove_queue(i);
+        }
+    }
+}
+
+void outbox_clear(uint32_t friendnumber)
+{
+    if (friendnumber >= index_capacity || queue_index[friendnumber] == 0) {
+        return;
+    }
+
+    remove_queue(queue_index[friendnumber] - 1);
+}
+
+size_t outbox_pending(void)
+{
+    return num_pending;
+}
+
+const struct Outbox_Stats *outbox_get_stats(void)
+{
+    return &stats;
+}
+
+void outbox_free(void)
+{
+    for (size_t i = 0; i < num_queues; ++i) {
+        free(queues[i].ring);
+    }
+
+    free(queues);
+    queues = NULL;
+    num_queues = 0;
+    queues_capacity = 0;
+
+    free(queue_index);
+    queue_index = NULL;
+    index_capacity = 0;
+
+    num_pending = 0;
+}
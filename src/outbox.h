@@ -0,0 +1,70 @@
+/*  outbox.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <tox/tox.h>
+
+/*
+ * Outbound messages to friends.
+ *
+ * A message is handed to toxcore right away unless the friend's send queue is full, in which case it
+ * waits in a bounded per-friend queue and is retried from the main loop. Messages to a friend are
+ * always delivered in the order they were sent. Whatever is waiting when the friend goes offline or
+ * is deleted is dropped.
+ */
+
+struct Outbox_Stats {
+    uint64_t sent;      // messages handed to toxcore
+    uint64_t deferred;  // messages that had to wait for the friend's send queue to drain
+    uint64_t dropped;   // messages lost to a full queue, a send error or the friend going offline
+    size_t   peak;      // the most messages that have been waiting at once
+};
+
+/*
+ * Sends a message to friendnumber, or queues it if toxcore's send queue for the friend is full.
+ * Messages longer than TOX_MAX_MESSAGE_LENGTH are truncated.
+ *
+ * Returns 0 if the message was sent or queued.
+ * Returns -1 if it was dropped.
+ */
+int outbox_send(Tox *m, uint32_t friendnumber, const char *message, size_t length);
+
+/* Retries queued messages until each friend's send queue fills up. This should be called once per main loop iteration. */
+void outbox_process(Tox *m);
+
+/* Drops every message queued for friendnumber. This must be called when a friend goes offline or is deleted. */
+void outbox_clear(uint32_t friendnumber);
+
+/* Returns the number of messages waiting to be sent. */
+size_t outbox_pending(void);
+
+/* Returns the delivery counters. */
+const struct Outbox_Stats *outbox_get_stats(void);
+
+/* Frees all queued messages. */
+void outbox_free(void);
+
+#endif /* OUTBOX_H */
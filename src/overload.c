@@ -0,0 +1,88 @@
+/*  overload.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "friends.h"
+#include "log.h"
+#include "misc.h"
+#include "overload.h"
+
+/* Weight of the latest tox_iterate() time in its moving average */
+#define ITERATE_TIME_WEIGHT 0.125
+
+/* We start shedding commands when the average tox_iterate() time rises above this, in microseconds */
+#define SHED_START_THRESHOLD 50000
+
+/* ...and stop once it falls back below this */
+#define SHED_STOP_THRESHOLD 20000
+
+static double iterate_time;
+static bool shedding;
+
+static struct Overload_Stats stats;
+
+void overload_record_iterate(uint64_t elapsed)
+{
+    iterate_time += (elapsed - iterate_time) * ITERATE_TIME_WEIGHT;
+
+    if (!shedding && iterate_time > SHED_START_THRESHOLD) {
+        shedding = true;
+        ++stats.overloads;
+        log_timestamp("Overloaded (tox_iterate() averaging %"PRIu64" ms); shedding commands", overload_iterate_time() / 1000);
+    } else if (shedding && iterate_time < SHED_STOP_THRESHOLD) {
+        shedding = false;
+        log_timestamp("No longer overloaded; %"PRIu64" commands shed so far", stats.shed);
+    }
+}
+
+Command_Admission overload_admit_command(Tox *m, uint32_t friendnumber)
+{
+    if (friend_get_role(m, friendnumber) == FRIEND_ROLE_MASTER) {
+        return COMMAND_ADMITTED;
+    }
+
+    if (!friend_take_command_token(friendnumber, get_monotonic_time())) {
+        ++stats.rate_limited;
+        return COMMAND_RATE_LIMITED;
+    }
+
+    if (shedding) {
+        ++stats.shed;
+        return COMMAND_SHED;
+    }
+
+    return COMMAND_ADMITTED;
+}
+
+bool overload_is_shedding(void)
+{
+    return shedding;
+}
+
+uint64_t overload_iterate_time(void)
+{
+    return (uint64_t) iterate_time;
+}
+
+const struct Overload_Stats *overload_get_stats(void)
+{
+    return &stats;
+}
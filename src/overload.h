@@ -0,0 +1,65 @@
+/*  overload.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef OVERLOAD_H
+#define OVERLOAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <tox/tox.h>
+
+/*
+ * Admission control for commands.
+ *
+ * Each friend may run commands at a limited rate. On top of that, while the main loop is overloaded,
+ * as measured by the time tox_iterate() takes, commands from friends who aren't masters are refused
+ * with a short busy reply until it recovers. Masters are exempt from both limits.
+ */
+
+typedef enum Command_Admission {
+    COMMAND_ADMITTED,
+    COMMAND_RATE_LIMITED,  // the friend is over its rate limit; the command should be dropped silently
+    COMMAND_SHED,          // the bot is overloaded; the friend should be told to try again later
+} Command_Admission;
+
+struct Overload_Stats {
+    uint64_t rate_limited;  // commands dropped because the friend was over its rate limit
+    uint64_t shed;          // commands refused while overloaded
+    uint64_t overloads;     // number of times we started shedding commands
+};
+
+/* Records how long a call to tox_iterate() took, in microseconds. This should be called once per main loop iteration. */
+void overload_record_iterate(uint64_t elapsed);
+
+/* Decides whether friendnumber may run a command now. */
+Command_Admission overload_admit_command(Tox *m, uint32_t friendnumber);
+
+/* Returns true while commands from non-masters are being shed. */
+bool overload_is_shedding(void);
+
+/* Returns the moving average of tox_iterate() wall time in microseconds. */
+uint64_t overload_iterate_time(void);
+
+/* Returns the admission counters. */
+const struct Overload_Stats *overload_get_stats(void);
+
+#endif /* OVERLOAD_H */
@@ -0,0 +1,62 @@
+/*  ratelimit.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "misc.h"
+#include "ratelimit.h"
+
+void token_bucket_init(struct Token_Bucket *bucket, double rate, double burst, uint64_t now)
+{
+    bucket->tokens = burst;
+    bucket->rate = rate;
+    bucket->burst = burst;
+    bucket->last_refill = now;
+}
+
+static void token_bucket_refill(struct Token_Bucket *bucket, uint64_t now)
+{
+    if (now <= bucket->last_refill) {
+        return;
+    }
+
+    double elapsed = (now - bucket->last_refill) / 1000000.0;
+    bucket->tokens = MIN(bucket->burst, bucket->tokens + elapsed * bucket->rate);
+    bucket->last_refill = now;
+}
+
+bool token_bucket_take(struct Token_Bucket *bucket, uint64_t now)
+{
+    token_bucket_refill(bucket, now);
+
+    if (bucket->tokens < 1.0) {
+        return false;
+    }
+
+    bucket->tokens -= 1.0;
+
+    return true;
+}
+
+bool token_bucket_ready(struct Token_Bucket *bucket, uint64_t now)
+{
+    token_bucket_refill(bucket, now);
+    return bucket->tokens >= 1.0;
+}
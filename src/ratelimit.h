@@ -0,0 +1,49 @@
+/*  ratelimit.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * A token bucket: holds up to `burst` tokens and refills at `rate` tokens per second. Times are
+ * monotonic microsecond timestamps as returned by get_monotonic_time().
+ */
+struct Token_Bucket {
+    double   tokens;
+    double   rate;
+    double   burst;
+    uint64_t last_refill;
+};
+
+/* Initializes `bucket` full. */
+void token_bucket_init(struct Token_Bucket *bucket, double rate, double burst, uint64_t now);
+
+/* Takes a token from `bucket`. Returns false if it's empty. */
+bool token_bucket_take(struct Token_Bucket *bucket, uint64_t now);
+
+/* Returns true if `bucket` has at least one token, without taking it. */
+bool token_bucket_ready(struct Token_Bucket *bucket, uint64_t now);
+
+#endif /* RATELIMIT_H */
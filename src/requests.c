@@ -0,0 +1,239 @@
+/*  requests.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "friends.h"
+#include "log.h"
+#include "misc.h"
+#include "ratelimit.h"
+#include "requests.h"
+#include "toxbot.h"
+
+/* Maximum number of requests waiting to be accepted; any more are dropped */
+#define REQUEST_QUEUE_SIZE 256
+
+/* Maximum number of requests accepted per main loop iteration */
+#define REQUEST_BATCH_SIZE 16
+
+/* Sustained and burst rate at which we accept requests */
+#define REQUEST_RATE 5.0
+#define REQUEST_BURST 20.0
+
+/* Sustained and burst rate at which we queue requests from keys sharing a prefix */
+#define PREFIX_RATE (1.0 / 60.0)
+#define PREFIX_BURST 3.0
+
+/* Keys are bucketed by their leading PREFIX_BITS bits */
+#define PREFIX_BITS 12
+#define NUM_PREFIX_BUCKETS (1 << PREFIX_BITS)
+
+struct Pending_Request {
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    bool    deferred;  // true once the request has been counted as deferred
+};
+
+static struct Pending_Request queue[REQUEST_QUEUE_SIZE];
+static size_t queue_head;
+static size_t queue_count;
+
+static struct Token_Bucket global_bucket;
+static struct Token_Bucket prefix_buckets[NUM_PREFIX_BUCKETS];
+
+static struct Request_Stats stats;
+
+extern struct Tox_Bot Tox_Bot;
+
+static size_t key_prefix(const uint8_t *public_key)
+{
+    return ((size_t) public_key[0] << 4 | public_key[1] >> 4) & (NUM_PREFIX_BUCKETS - 1);
+}
+
+void requests_init(void)
+{
+    uint64_t now = get_monotonic_time();
+
+    token_bucket_init(&global_bucket, REQUEST_RATE, REQUEST_BURST, now);
+
+    for (size_t i = 0; i < NUM_PREFIX_BUCKETS; ++i) {
+        token_bucket_init(&prefix_buckets[i], PREFIX_RATE, PREFIX_BURST, now);
+    }
+}
+
+/* Returns true if a request from `public_key` is already waiting in the queue. */
+static bool request_is_queued(const uint8_t *public_key)
+{
+    for (size_t i = 0; i < queue_count; ++i) {
+        const struct Pending_Request *req = &queue[(queue_head + i) % REQUEST_QUEUE_SIZE];
+
+        if (memcmp(req->public_key, public_key, TOX_PUBLIC_KEY_SIZE) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void requests_submit(const uint8_t *public_key)
+{
+    /* a repeated request is checked before the prefix bucket so that it doesn't spend its neighbours' tokens */
+    if (queue_count == REQUEST_QUEUE_SIZE || request_is_queued(public_key)
+            || !token_bucket_take(&prefix_buckets[key_prefix(public_key)], get_monotonic_time())) {
+        ++stats.dropped;
+        return;
+    }
+
+    struct Pending_Request *req = &queue[(queue_head + queue_count) % REQUEST_QUEUE_SIZE];
+    memcpy(req->public_key, public_key, TOX_PUBLIC_KEY_SIZE);
+    req->deferred = false;
+    ++queue_count;
+}
+
+/*
+ * Deletes the least recently active non-master friend to make room for a new one.
+ *
+ * Returns 0 on success.
+ * Returns -1 if every friend is a master.
+ */
+static int evict_friend(Tox *m)
+{
+    uint32_t friendnumber;
+
+    if (!friends_get_evictable(m, &friendnumber)) {
+        return -1;
+    }
+
+    tox_friend_delete(m, friendnumber, NULL);
+    friend_reset(friendnumber);
+    ++stats.evicted;
+
+    return 0;
+}
+
+/* Returns true if `public_key` can be added as a friend, so that nobody is evicted for a request that would fail. */
+static bool can_add_friend(const Tox *m, const uint8_t *public_key)
+{
+    uint8_t self_key[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_public_key(m, self_key);
+
+    if (memcmp(public_key, self_key, TOX_PUBLIC_KEY_SIZE) == 0) {
+        return false;
+    }
+
+    Tox_Err_Friend_By_Public_Key err;
+    tox_friend_by_public_key(m, public_key, &err);
+
+    return err != TOX_ERR_FRIEND_BY_PUBLIC_KEY_OK;
+}
+
+uint32_t requests_process(Tox *m)
+{
+    if (queue_count == 0) {
+        return 0;
+    }
+
+    uint64_t now = get_monotonic_time();
+    uint32_t added = 0;
+    uint32_t evicted = 0;
+    size_t num_friends = Tox_Bot.max_friends > 0 ? tox_self_get_friend_list_size(m) : 0;
+
+    for (size_t i = 0; i < REQUEST_BATCH_SIZE && queue_count > 0; ++i) {
+        struct Pending_Request *req = &queue[queue_head];
+
+        /* requests that can't be added are dropped without spending a token */
+        if (!can_add_friend(m, req->public_key)) {
+            queue_head = (queue_head + 1) % REQUEST_QUEUE_SIZE;
+            --queue_count;
+            ++stats.dropped;
+            continue;
+        }
+
+        if (!token_bucket_take(&global_bucket, now)) {
+            break;
+        }
+
+        queue_head = (queue_head + 1) % REQUEST_QUEUE_SIZE;
+        --queue_count;
+
+        if (Tox_Bot.max_friends > 0 && num_friends >= Tox_Bot.max_friends) {
+            if (evict_friend(m) != 0) {
+                ++stats.dropped;
+                continue;
+            }
+
+            --num_friends;
+            ++evicted;
+        }
+
+        TOX_ERR_FRIEND_ADD err;
+        uint32_t friendnumber = tox_friend_add_norequest(m, req->public_key, &err);
+
+        if (err != TOX_ERR_FRIEND_ADD_OK) {
+            log_error_timestamp(err, "tox_friend_add_norequest failed");
+            ++stats.dropped;
+            continue;
+        }
+
+        friend_reset(friendnumber);
+        friend_set_last_online(friendnumber, get_time());
+        friend_touch(friendnumber);
+        ++stats.accepted;
+        ++added;
+        ++num_friends;
+    }
+
+    /* Whatever is still queued waits for the rate limit. Walk back from the newest request, as the
+     * older ones at the front of the queue have already been counted. */
+    for (size_t i = queue_count; i-- > 0;) {
+        struct Pending_Request *req = &queue[(queue_head + i) % REQUEST_QUEUE_SIZE];
+
+        if (req->deferred) {
+            break;
+        }
+
+        req->deferred = true;
+        ++stats.deferred;
+    }
+
+    if (added > 0) {
+        log_timestamp("Accepted %"PRIu32" friend request%s (%zu pending)", added, added == 1 ? "" : "s", queue_count);
+    }
+
+    if (evicted > 0) {
+        log_timestamp("Evicted %"PRIu32" least recently active friend%s", evicted, evicted == 1 ? "" : "s");
+    }
+
+    /* evictions also change the friend list */
+    return added + evicted;
+}
+
+size_t requests_pending(void)
+{
+    return queue_count;
+}
+
+const struct Request_Stats *requests_get_stats(void)
+{
+    return &stats;
+}
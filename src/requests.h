@@ -0,0 +1,69 @@
+/*  requests.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef REQUESTS_H
+#define REQUESTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <tox/tox.h>
+
+/*
+ * Admission control for incoming friend requests.
+ *
+ * Requests are queued from the friend request callback and accepted from the main loop in batches,
+ * at a rate limited by a global token bucket. Each key prefix also has its own bucket so that one
+ * sender can't monopolize the queue.
+ *
+ * When the friend list is at Tox_Bot.max_friends, accepting a request evicts the least recently active
+ * friend who is not a master.
+ */
+
+struct Request_Stats {
+    uint64_t accepted;  // requests we added as friends
+    uint64_t deferred;  // requests that had to wait in the queue for the global rate limit
+    uint64_t dropped;   // requests refused because the queue was full, they were already queued, their key
+                        // prefix was over its limit or the friend couldn't be added
+    uint64_t evicted;   // friends deleted to make room for accepted requests
+};
+
+/* Initializes the rate limiters. */
+void requests_init(void);
+
+/* Queues a friend request from `public_key` for acceptance, or drops it if it's already queued or over a limit. */
+void requests_submit(const uint8_t *public_key);
+
+/*
+ * Accepts up to one batch of queued requests, as far as the global rate limit allows. This should
+ * be called once per main loop iteration.
+ *
+ * Returns the number of friends that were added or evicted.
+ */
+uint32_t requests_process(Tox *m);
+
+/* Returns the number of requests waiting in the queue. */
+size_t requests_pending(void);
+
+/* Returns the admission counters. */
+const struct Request_Stats *requests_get_stats(void);
+
+#endif /* REQUESTS_H */
@@ -0,0 +1,104 @@
+/*  response.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "outbox.h"
+#include "response.h"
+
+void response_init(struct Response *resp, Tox *m, uint32_t friendnumber)
+{
+    resp->m = m;
+    resp->friendnumber = friendnumber;
+    resp->length = 0;
+}
+
+void response_flush(struct Response *resp)
+{
+    if (resp->length == 0) {
+        return;
+    }
+
+    outbox_send(resp->m, resp->friendnumber, resp->frame, resp->length);
+    resp->length = 0;
+}
+
+/* Returns the largest length no greater than `max` that doesn't cut a UTF-8 char in `s` in two. */
+static size_t utf8_boundary(const char *s, size_t max)
+{
+    size_t len = max;
+
+    while (len > 0 && ((uint8_t) s[len] & 0xC0) == 0x80) {
+        --len;
+    }
+
+    /* not UTF-8; cut it anywhere */
+    return len > 0 ? len : max;
+}
+
+void response_add_line(struct Response *resp, const char *line, size_t length)
+{
+    size_t sep = resp->length > 0 ? 1 : 0;
+
+    if (resp->length + sep + length > sizeof(resp->frame)) {
+        response_flush(resp);
+        sep = 0;
+    }
+
+    /* a line that doesn't fit in a frame of its own goes out in pieces */
+    while (length > sizeof(resp->frame)) {
+        size_t len = utf8_boundary(line, sizeof(resp->frame));
+        outbox_send(resp->m, resp->friendnumber, line, len);
+        line += len;
+        length -= len;
+    }
+
+    if (sep) {
+        resp->frame[resp->length++] = '\n';
+    }
+
+    memcpy(resp->frame + resp->length, line, length);
+    resp->length += length;
+}
+
+void response_printf(struct Response *resp, const char *format, ...)
+{
+    /* one byte over a frame, so a line that's cut short can be cut on a char boundary */
+    char line[TOX_MAX_MESSAGE_LENGTH + 2];
+
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (len < 0) {
+        return;
+    }
+
+    if (len > TOX_MAX_MESSAGE_LENGTH) {
+        len = utf8_boundary(line, TOX_MAX_MESSAGE_LENGTH);
+    }
+
+    response_add_line(resp, line, len);
+}
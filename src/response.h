@@ -0,0 +1,54 @@
+/*  response.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <tox/tox.h>
+
+/*
+ * Builds a multi-line reply to a friend, packing its lines into as few TOX_MAX_MESSAGE_LENGTH messages
+ * as possible. Lines are never split unless a single line is longer than a message, in which case it's
+ * split on a UTF-8 char boundary.
+ */
+struct Response {
+    Tox      *m;
+    uint32_t  friendnumber;
+    size_t    length;
+    char      frame[TOX_MAX_MESSAGE_LENGTH];
+};
+
+/* Starts an empty reply to friendnumber. */
+void response_init(struct Response *resp, Tox *m, uint32_t friendnumber);
+
+/* Appends a line of `length` bytes to the reply, sending the frame built so far first if it doesn't fit. */
+void response_add_line(struct Response *resp, const char *line, size_t length);
+
+/* Appends a printf formatted line to the reply. */
+void response_printf(struct Response *resp, const char *format, ...);
+
+/* Sends whatever is left of the reply. This must be called once the reply is complete. */
+void response_flush(struct Response *resp);
+
+#endif /* RESPONSE_H */
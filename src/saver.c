@@ -0,0 +1,434 @@
+/*  saver.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "saver.h"
+
+struct Snapshot {
+    uint8_t *data;
+    size_t   length;
+    size_t   capacity;
+};
+
+/* A file the I/O thread writes, with its own pair of snapshot buffers. Protected by the saver lock. */
+struct Save_Slot {
+    const char      *path;
+    struct Snapshot  buffers[2];
+    struct Snapshot *pending;   // filled by the tox thread
+    struct Snapshot *writing;   // owned by the I/O thread while it writes
+    bool             has_pending;
+    bool             failed;
+};
+
+enum {
+    SLOT_PROFILE,
+    SLOT_DATA,
+    NUM_SLOTS,
+};
+
+static struct Saver {
+    pthread_t     thread;
+    bool          running;
+    Tox_Pass_Key *pass_key;     // set before the thread starts and read-only afterwards
+    struct Snapshot ciphertext; // owned by whichever thread is writing
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+
+    /* Everything below is protected by lock */
+    struct Save_Slot slots[NUM_SLOTS];
+    bool             stop;
+    uint64_t         num_writes;  // profile writes
+} saver = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .slots = {
+        [SLOT_PROFILE] = { .pending = &saver.slots[SLOT_PROFILE].buffers[0], .writing = &saver.slots[SLOT_PROFILE].buffers[1] },
+        [SLOT_DATA]    = { .pending = &saver.slots[SLOT_DATA].buffers[0],    .writing = &saver.slots[SLOT_DATA].buffers[1]    },
+    },
+};
+
+/* Writes all of `data` to `fd`, retrying on short writes. Returns 0 on success. */
+static int write_all(int fd, const uint8_t *data, size_t length)
+{
+    while (length > 0) {
+        ssize_t ret = write(fd, data, length);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        data += ret;
+        length -= ret;
+    }
+
+    return 0;
+}
+
+int save_file_atomic(const char *path, const uint8_t *data, size_t length)
+{
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+    if (fd == -1) {
+        goto on_error;
+    }
+
+    if (write_all(fd, data, length) != 0 || fsync(fd) != 0) {
+        close(fd);
+        unlink(temp_path);
+        goto on_error;
+    }
+
+    close(fd);
+
+    if (rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        goto on_error;
+    }
+
+    /* make the rename itself durable */
+    int dir_fd = open(".", O_RDONLY);
+
+    if (dir_fd != -1) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    return 0;
+
+on_error:
+    log_error_timestamp(errno, "Warning: failed to write '%s'", path);
+    return -1;
+}
+
+/* Ensures `snapshot` can hold `length` bytes. Returns 0 on success. */
+static int snapshot_reserve(struct Snapshot *snapshot, size_t length)
+{
+    if (length <= snapshot->capacity) {
+        return 0;
+    }
+
+    uint8_t *data = realloc(snapshot->data, length);
+
+    if (data == NULL) {
+        return -1;
+    }
+
+    snapshot->data = data;
+    snapshot->capacity = length;
+
+    return 0;
+}
+
+/* Encrypts `data` with the cached pass key into `out`. Returns 0 on success. */
+static int encrypt_data(struct Snapshot *out, const uint8_t *data, size_t length)
+{
+    size_t enc_length = length + TOX_PASS_ENCRYPTION_EXTRA_LENGTH;
+
+    if (snapshot_reserve(out, enc_length) != 0) {
+        return -1;
+    }
+
+    Tox_Err_Encryption err;
+
+    if (!tox_pass_key_encrypt(saver.pass_key, data, length, out->data, &err)) {
+        log_error_timestamp(err, "Warning: failed to encrypt save data");
+        return -1;
+    }
+
+    out->length = enc_length;
+
+    return 0;
+}
+
+/* Writes `snapshot` to `path`, encrypting it first if we have a pass key. */
+static int write_snapshot(const char *path, const struct Snapshot *snapshot)
+{
+    if (saver.pass_key == NULL) {
+        return save_file_atomic(path, snapshot->data, snapshot->length);
+    }
+
+    if (encrypt_data(&saver.ciphertext, snapshot->data, snapshot->length) != 0) {
+        return -1;
+    }
+
+    return save_file_atomic(path, saver.ciphertext.data, saver.ciphertext.length);
+}
+
+/* Returns the slot with a pending snapshot, or NULL if there is none. Must be called with the lock held. */
+static struct Save_Slot *next_pending_slot(void)
+{
+    for (size_t i = 0; i < NUM_SLOTS; ++i) {
+        if (saver.slots[i].has_pending) {
+            return &saver.slots[i];
+        }
+    }
+
+    return NULL;
+}
+
+int save_profile_data(const char *path, const uint8_t *data, size_t length)
+{
+    if (saver.pass_key == NULL) {
+        return save_file_atomic(path, data, length);
+    }
+
+    struct Snapshot ciphertext = {
+        0
+    };
+    int ret = encrypt_data(&ciphertext, data, length);
+
+    if (ret == 0) {
+        ret = save_file_atomic(path, ciphertext.data, ciphertext.length);
+    }
+
+    free(ciphertext.data);
+
+    return ret;
+}
+
+int saver_set_passphrase(const uint8_t *passphrase, size_t length, const uint8_t *salt)
+{
+    Tox_Err_Key_Derivation err;
+    Tox_Pass_Key *key;
+
+    if (salt != NULL) {
+        key = tox_pass_key_derive_with_salt(passphrase, length, salt, &err);
+    } else {
+        key = tox_pass_key_derive(passphrase, length, &err);
+    }
+
+    if (key == NULL) {
+        fprintf(stderr, "Warning: failed to derive key from passphrase (error %d)\n", err);
+        return -1;
+    }
+
+    tox_pass_key_free(saver.pass_key);
+    saver.pass_key = key;
+
+    return 0;
+}
+
+const Tox_Pass_Key *saver_get_pass_key(void)
+{
+    return saver.pass_key;
+}
+
+static void *saver_thread(void *arg)
+{
+    pthread_mutex_lock(&saver.lock);
+
+    while (true) {
+        struct Save_Slot *slot;
+
+        while ((slot = next_pending_slot()) == NULL && !saver.stop) {
+            pthread_cond_wait(&saver.cond, &saver.lock);
+        }
+
+        if (slot == NULL) {
+            break;
+        }
+
+        struct Snapshot *snapshot = slot->pending;
+        slot->pending = slot->writing;
+        slot->writing = snapshot;
+        slot->has_pending = false;
+
+        const char *path = slot->path;
+
+        pthread_mutex_unlock(&saver.lock);
+
+        int ret = write_snapshot(path, snapshot);
+
+        pthread_mutex_lock(&saver.lock);
+
+        if (ret != 0) {
+            slot->failed = true;
+        } else if (slot == &saver.slots[SLOT_PROFILE]) {
+            ++saver.num_writes;
+        }
+    }
+
+    pthread_mutex_unlock(&saver.lock);
+
+    return NULL;
+}
+
+int saver_init(const char *path)
+{
+    saver.slots[SLOT_PROFILE].path = path;
+
+    if (pthread_create(&saver.thread, NULL, saver_thread, NULL) != 0) {
+        fprintf(stderr, "Warning: failed to start saver thread; saves will block\n");
+        return -1;
+    }
+
+    saver.running = true;
+
+    return 0;
+}
+
+/*
+ * Hands the snapshot just filled in for `slot` to the I/O thread, or writes it synchronously if the
+ * thread isn't running. Must be called with the lock held; releases it.
+ */
+static int submit_slot(struct Save_Slot *slot)
+{
+    if (!saver.running) {
+        int ret = write_snapshot(slot->path, slot->pending);
+
+        if (ret == 0 && slot == &saver.slots[SLOT_PROFILE]) {
+            ++saver.num_writes;
+        }
+
+        pthread_mutex_unlock(&saver.lock);
+        return ret;
+    }
+
+    slot->has_pending = true;
+    pthread_cond_signal(&saver.cond);
+    pthread_mutex_unlock(&saver.lock);
+
+    return 0;
+}
+
+int saver_submit(const Tox *m)
+{
+    struct Save_Slot *slot = &saver.slots[SLOT_PROFILE];
+
+    if (slot->path == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&saver.lock);
+
+    struct Snapshot *snapshot = slot->pending;
+    size_t length = tox_get_savedata_size(m);
+
+    if (snapshot_reserve(snapshot, length) != 0) {
+        pthread_mutex_unlock(&saver.lock);
+        return -1;
+    }
+
+    tox_get_savedata(m, snapshot->data);
+    snapshot->length = length;
+
+    return submit_slot(slot);
+}
+
+int saver_submit_data(const char *path, const uint8_t *data, size_t length)
+{
+    struct Save_Slot *slot = &saver.slots[SLOT_DATA];
+
+    pthread_mutex_lock(&saver.lock);
+
+    struct Snapshot *snapshot = slot->pending;
+
+    if (snapshot_reserve(snapshot, length) != 0) {
+        pthread_mutex_unlock(&saver.lock);
+        return -1;
+    }
+
+    memcpy(snapshot->data, data, length);
+    snapshot->length = length;
+    slot->path = path;
+
+    return submit_slot(slot);
+}
+
+/* Returns and clears the failure flag of `slot`. */
+static bool poll_slot_failed(struct Save_Slot *slot)
+{
+    pthread_mutex_lock(&saver.lock);
+    bool failed = slot->failed;
+    slot->failed = false;
+    pthread_mutex_unlock(&saver.lock);
+
+    return failed;
+}
+
+bool saver_poll_failed(void)
+{
+    return poll_slot_failed(&saver.slots[SLOT_PROFILE]);
+}
+
+bool saver_poll_data_failed(void)
+{
+    return poll_slot_failed(&saver.slots[SLOT_DATA]);
+}
+
+uint64_t saver_num_writes(void)
+{
+    pthread_mutex_lock(&saver.lock);
+    uint64_t num_writes = saver.num_writes;
+    pthread_mutex_unlock(&saver.lock);
+
+    return num_writes;
+}
+
+void saver_shutdown(void)
+{
+    if (saver.running) {
+        pthread_mutex_lock(&saver.lock);
+        saver.stop = true;
+        pthread_cond_signal(&saver.cond);
+        pthread_mutex_unlock(&saver.lock);
+
+        /* the thread writes any pending snapshot before it sees the stop flag */
+        pthread_join(saver.thread, NULL);
+        saver.running = false;
+    }
+
+    for (size_t i = 0; i < NUM_SLOTS; ++i) {
+        for (size_t j = 0; j < 2; ++j) {
+            free(saver.slots[i].buffers[j].data);
+            saver.slots[i].buffers[j] = (struct Snapshot) {
+                0
+            };
+        }
+    }
+
+    free(saver.ciphertext.data);
+    saver.ciphertext = (struct Snapshot) {
+        0
+    };
+
+    tox_pass_key_free(saver.pass_key);
+    saver.pass_key = NULL;
+}
@@ -0,0 +1,112 @@
+/*  saver.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SAVER_H
+#define SAVER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <tox/tox.h>
+#include <tox/toxencryptsave.h>
+
+/*
+ * Writes snapshots of the Tox profile on a dedicated I/O thread.
+ *
+ * The tox thread only copies the profile into a pending buffer; the I/O thread swaps that buffer with
+ * the one it writes from, so taking a snapshot never waits on the disk. One other data file can be
+ * written the same way from a buffer the caller builds.
+ */
+
+/*
+ * Derives the key that snapshots are encrypted with from `passphrase`. If `salt` is non-NULL the key is
+ * derived with that salt, as needed to decrypt an existing profile; otherwise a random salt is chosen.
+ *
+ * Key derivation is deliberately slow, so it is done once here and the key reused for every write.
+ * This must be called before saver_init().
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int saver_set_passphrase(const uint8_t *passphrase, size_t length, const uint8_t *salt);
+
+/* Returns the key snapshots are encrypted with, or NULL if they're written in plaintext. */
+const Tox_Pass_Key *saver_get_pass_key(void);
+
+/*
+ * Starts the thread that writes snapshots to `path`, which must outlive the saver.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the thread could not be started, in which case snapshots are written synchronously.
+ */
+int saver_init(const char *path);
+
+/*
+ * Copies the current profile into the pending snapshot and wakes the I/O thread. A pending snapshot
+ * that hasn't been picked up yet is replaced.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int saver_submit(const Tox *m);
+
+/*
+ * Copies `data` into the pending snapshot of the data file at `path`, which must outlive the saver,
+ * and wakes the I/O thread. The data file is encrypted like the profile if a passphrase was set.
+ * Only one data file is supported, so every call should pass the same path.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int saver_submit_data(const char *path, const uint8_t *data, size_t length);
+
+/* Returns true if a snapshot of the profile failed to be written since the last call. */
+bool saver_poll_failed(void);
+
+/* Returns true if a snapshot of the data file failed to be written since the last call. */
+bool saver_poll_data_failed(void);
+
+/* Returns the number of snapshots that have been written. */
+uint64_t saver_num_writes(void);
+
+/* Writes out the pending snapshots, if any, stops the I/O thread and forgets the encryption key. */
+void saver_shutdown(void);
+
+/*
+ * Atomically replaces the file at `path` with `data`: the data is written and synced to a temporary
+ * file which is then renamed over `path`, so a crash leaves either the old or the new file intact.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int save_file_atomic(const char *path, const uint8_t *data, size_t length);
+
+/*
+ * Writes the profile in `data` to `path` with save_file_atomic(), encrypting it first if a passphrase
+ * was set. This blocks until the file is on disk.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int save_profile_data(const char *path, const uint8_t *data, size_t length);
+
+#endif /* SAVER_H */
@@ -0,0 +1,119 @@
+/*  tokenizer.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+
+#include "tokenizer.h"
+
+#define SPACES 0x2020202020202020ULL
+
+/* Returns the index of the first char at or after `i` that isn't a space, or `length` if there is none. */
+static size_t skip_spaces(const char *buf, size_t i, size_t length)
+{
+    /* runs of spaces are skipped a word at a time so that padding can't make parsing slow */
+    while (i + sizeof(uint64_t) <= length) {
+        uint64_t word;
+        memcpy(&word, buf + i, sizeof(word));
+
+        if (word != SPACES) {
+            break;
+        }
+
+        i += sizeof(word);
+    }
+
+    while (i < length && buf[i] == ' ') {
+        ++i;
+    }
+
+    return i;
+}
+
+int tokenize(char *buf, size_t length, struct Token *tokens, int max_tokens)
+{
+    size_t i = 0;
+    int count = 0;
+
+    while (count < max_tokens) {
+        i = skip_spaces(buf, i, length);
+
+        if (i >= length) {
+            break;
+        }
+
+        struct Token *token = &tokens[count++];
+
+        if (buf[i] == '\"') {
+            size_t start = ++i;
+            size_t out = start;  // unescaped chars are compacted towards the start of the token
+            const char *quote;
+
+            /* copy the token a span at a time, stopping only at escapes */
+            while ((quote = memchr(buf + i, '\"', length - i)) != NULL) {
+                size_t end = quote - buf;
+                const char *escape = memchr(buf + i, '\\', end - i);
+                size_t span = (escape ? (size_t) (escape - buf) : end) - i;
+
+                if (out != i) {
+                    memmove(buf + out, buf + i, span);
+                }
+
+                out += span;
+                i += span;
+
+                if (escape == NULL) {
+                    break;
+                }
+
+                /* an escaped char is copied without its backslash; a lone backslash is kept */
+                if (i + 1 < length && (buf[i + 1] == '\"' || buf[i + 1] == '\\')) {
+                    ++i;
+                }
+
+                buf[out++] = buf[i++];
+            }
+
+            if (quote == NULL) {
+                return -1;
+            }
+
+            buf[out] = '\0';  // out is at most i, the index of the closing quote
+            ++i;
+
+            token->offset = start;
+            token->length = out - start;
+            token->quoted = true;
+        } else {
+            const char *space = memchr(buf + i, ' ', length - i);
+            size_t end = space ? (size_t) (space - buf) : length;
+
+            token->offset = i;
+            token->length = end - i;
+            token->quoted = false;
+
+            buf[end] = '\0';
+            i = space ? end + 1 : length;
+        }
+    }
+
+    return count;
+}
@@ -0,0 +1,52 @@
+/*  tokenizer.h
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A token, as a view into the buffer it was parsed from */
+struct Token {
+    uint16_t offset;  // index of the first char of the token, after any opening quote
+    uint16_t length;  // length of the token, not counting quotes or escape chars
+    bool     quoted;  // true if the token was enclosed in double quotes
+};
+
+/*
+ * Splits the first `length` chars of `buf` into at most `max_tokens` space separated tokens in a
+ * single pass, without allocating. Anything after the last token is ignored.
+ *
+ * A token that begins with a double quote extends to the matching closing quote and may contain
+ * spaces; within it, \" stands for a quote and \\ for a backslash.
+ *
+ * `buf` is modified in place: quotes and escape chars are removed and every token is null terminated,
+ * so `buf + tokens[i].offset` is a C string. `buf[length]` must be writable.
+ *
+ * Returns the number of tokens.
+ * Returns -1 if a quoted token is not closed.
+ */
+int tokenize(char *buf, size_t length, struct Token *tokens, int max_tokens);
+
+#endif /* TOKENIZER_H */
@@ -25,7 +25,11 @@
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <signal.h>
 #include <getopt.h>
@@ -35,18 +39,31 @@
 #include <tox/toxav.h>
 
 #include "misc.h"
+#include "broadcast.h"
+#include "codec.h"
 #include "commands.h"
+#include "friends.h"
 #include "toxbot.h"
 #include "groupchats.h"
+#include "groupstore.h"
+#include "keylist.h"
 #include "log.h"
-
-#define VERSION "0.1.2"
+#include "outbox.h"
+#include "overload.h"
+#include "requests.h"
+#include "saver.h"
 
 /* How often we attempt to purge inactive friends */
 #define FRIEND_PURGE_INTERVAL (60 * 60)
 
-/* How often we attempt to purge inactive groups */
-#define GROUP_PURGE_INTERVAL (60 * 10)
+/* The most time a single main loop iteration spends purging inactive friends, in microseconds */
+#define FRIEND_PURGE_TIME_BUDGET 2000
+
+/* How often we check the online friend count against toxcore */
+#define FRIEND_CHECK_INTERVAL (60 * 5)
+
+/* How long a group must have been empty before it's purged */
+#define GROUP_EMPTY_GRACE (60 * 10)
 
 /* How long we need to have had a stable connection before purging inactive groups */
 #define GROUP_PURGE_CONNECT_TIMEOUT (60 * 60)
@@ -54,8 +71,22 @@
 /* How often we attempt to bootstrap when not presently connected to the network */
 #define BOOTSTRAP_INTERVAL 20
 
+/* The shortest interval between writes of the data file; changes made in between are coalesced */
+#define SAVE_INTERVAL 10
+
 #define MAX_PORT_RANGE 65535
 
+/* Smallest valid data file: a zero word followed by the toxcore state cookie */
+#define DATA_FILE_MIN_SIZE 8
+
+/* Refuse to load data files larger than this; toxcore copies the whole profile into memory */
+#define DATA_FILE_MAX_SIZE (256 * 1024 * 1024)
+
+/* Environment variable the data file passphrase is read from when no passphrase file is given */
+#define PASSPHRASE_ENV "TOXBOT_PASSPHRASE"
+
+#define MAX_PASSPHRASE_LENGTH 512
+
 /* Name of data file prior to version 0.1.1 */
 #define DATA_FILE_PRE_0_1_1 "toxbot_save"
 
@@ -70,6 +101,8 @@ static struct Options {
     bool      disable_udp;
     bool      disable_lan;
     bool      force_ipv4;
+    char      passphrase_file[PATH_MAX];
+    uint32_t  max_friends;
 } Options;
 
 static void init_toxbot_state(void)
@@ -77,8 +110,8 @@ static void init_toxbot_state(void)
     Tox_Bot.start_time = get_time();
     Tox_Bot.last_connected = get_time();
     Tox_Bot.default_groupnum = 0;
-    Tox_Bot.chats_idx = 0;
     Tox_Bot.num_online_friends = 0;
+    Tox_Bot.max_friends = Options.max_friends;
 
     /* 1 year default; anything lower should be explicitly set until we have a config file */
     Tox_Bot.inactive_limit = 31536000;
@@ -89,9 +122,59 @@ static void catch_SIGINT(int sig)
     FLAG_EXIT = true;
 }
 
+/* Hands a snapshot of the group store to the saver thread, returning 0 on success and -1 on failure. */
+static int save_groups_store(Tox *m)
+{
+    struct Group_Store_Settings settings = {
+        .default_groupnum = Tox_Bot.default_groupnum,
+        .inactive_limit = Tox_Bot.inactive_limit,
+    };
+
+    return group_store_save(m, GROUPS_STORE, &settings);
+}
+
+void request_groups_save(void)
+{
+    Tox_Bot.groups_save_pending = true;
+}
+
+/* Saves the group store if it's out of date and we haven't saved it within the last SAVE_INTERVAL seconds. */
+static void flush_groups_store(Tox *m, time_t cur_time)
+{
+    if (saver_poll_data_failed()) {
+        Tox_Bot.groups_save_pending = true;
+    }
+
+    if (!Tox_Bot.groups_save_pending || !timed_out(Tox_Bot.last_groups_save, cur_time, SAVE_INTERVAL)) {
+        return;
+    }
+
+    Tox_Bot.last_groups_save = cur_time;
+
+    if (save_groups_store(m) != 0) {
+        log_error_timestamp(-1, "Warning: failed to save group store");
+        return;
+    }
+
+    Tox_Bot.groups_save_pending = false;
+}
+
 static void exit_toxbot(Tox *m)
 {
-    save_data(m, DATA_FILE);
+    if (saver_submit(m) != 0) {
+        log_error_timestamp(-1, "Warning: failed to save data file on exit");
+    }
+
+    if (Tox_Bot.groups_save_pending && save_groups_store(m) != 0) {
+        log_error_timestamp(-1, "Warning: failed to save group store on exit");
+    }
+
+    saver_shutdown();
+    key_list_free(&Tox_Bot.master_keys);
+    key_list_free(&Tox_Bot.blocked_keys);
+    friends_free();
+    groups_free();
+    outbox_free();
     tox_kill(m);
     exit(EXIT_SUCCESS);
 }
@@ -99,19 +182,13 @@ static void exit_toxbot(Tox *m)
 /* Returns true if friendnumber's Tox ID is in the masterkeys list. */
 bool friend_is_master(Tox *m, uint32_t friendnumber)
 {
-    char public_key[TOX_PUBLIC_KEY_SIZE];
-
-    if (tox_friend_get_public_key(m, friendnumber, (uint8_t *) public_key, NULL) == 0) {
-        return false;
-    }
-
-    return file_contains_key(public_key, MASTERLIST_FILE) == 1;
+    return friend_get_role(m, friendnumber) == FRIEND_ROLE_MASTER;
 }
 
 /* Returns true if public_key is in the blockedkeys list. */
 static bool public_key_is_blocked(const char *public_key)
 {
-    return file_contains_key(public_key, BLOCKLIST_FILE) == 1;
+    return key_list_contains(&Tox_Bot.blocked_keys, (const uint8_t *) public_key);
 }
 
 /* START CALLBACKS */
@@ -137,22 +214,12 @@ static void cb_self_connection_change(Tox *m, TOX_CONNECTION connection_status,
 
 static void cb_friend_connection_change(Tox *m, uint32_t friendnumber, TOX_CONNECTION connection_status, void *userdata)
 {
-    Tox_Bot.num_online_friends = 0;
-
-    size_t i, size = tox_self_get_friend_list_size(m);
-
-    if (size == 0) {
-        return;
-    }
-
-    uint32_t list[size];
-    tox_self_get_friend_list(m, list);
+    friend_set_connection_status(friendnumber, connection_status);
+}
 
-    for (i = 0; i < size; ++i) {
-        if (tox_friend_get_connection_status(m, list[i], NULL) != TOX_CONNECTION_NONE) {
-            ++Tox_Bot.num_online_friends;
-        }
-    }
+static void cb_friend_name(Tox *m, uint32_t friendnumber, const uint8_t *name, size_t length, void *userdata)
+{
+    friend_set_name(friendnumber, name, length);
 }
 
 static void cb_friend_request(Tox *m, const uint8_t *public_key, const uint8_t *data, size_t length,
@@ -162,16 +229,8 @@ static void cb_friend_request(Tox *m, const uint8_t *public_key, const uint8_t *
         return;
     }
 
-    TOX_ERR_FRIEND_ADD err;
-    tox_friend_add_norequest(m, public_key, &err);
-
-    if (err != TOX_ERR_FRIEND_ADD_OK) {
-        log_error_timestamp(err, "tox_friend_add_norequest failed");
-    } else {
-        log_timestamp("Accepted friend request");
-    }
-
-    save_data(m, DATA_FILE);
+    /* accepted from the main loop by requests_process() */
+    requests_submit(public_key);
 }
 
 static void cb_friend_message(Tox *m, uint32_t friendnumber, TOX_MESSAGE_TYPE type, const uint8_t *string,
@@ -181,25 +240,42 @@ static void cb_friend_message(Tox *m, uint32_t friendnumber, TOX_MESSAGE_TYPE ty
         return;
     }
 
-    char public_key[TOX_PUBLIC_KEY_SIZE];
+    Friend_Role role = friend_get_role(m, friendnumber);
 
-    if (tox_friend_get_public_key(m, friendnumber, (uint8_t *) public_key, NULL) == 0) {
+    if (role == FRIEND_ROLE_UNKNOWN) {
         return;
     }
 
-    if (public_key_is_blocked(public_key)) {
+    if (role == FRIEND_ROLE_BLOCKED) {
         tox_friend_delete(m, friendnumber, NULL);
+        friend_reset(friendnumber);
         return;
     }
 
+    friend_touch(friendnumber);
+
     const char *outmsg;
+
+    switch (overload_admit_command(m, friendnumber)) {
+        case COMMAND_ADMITTED:
+            break;
+
+        case COMMAND_RATE_LIMITED:
+            return;
+
+        case COMMAND_SHED:
+            outmsg = "I'm busy right now. Please try again in a minute.";
+            outbox_send(m, friendnumber, outmsg, strlen(outmsg));
+            return;
+    }
+
     char message[TOX_MAX_MESSAGE_LENGTH];
     length = copy_tox_str(message, sizeof(message), (const char *) string, length);
     message[length] = '\0';
 
     if (length && execute(m, friendnumber, message, length) == -1) {
         outmsg = "Invalid command. Type help for a list of commands";
-        tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        outbox_send(m, friendnumber, outmsg, strlen(outmsg));
     }
 }
 
@@ -210,10 +286,7 @@ static void cb_group_invite(Tox *m, uint32_t friendnumber, TOX_CONFERENCE_TYPE t
         return;
     }
 
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnumber, (uint8_t *) name, NULL);
-    size_t len = tox_friend_get_name_size(m, friendnumber, NULL);
-    name[len] = '\0';
+    const char *name = friend_get_name(m, friendnumber);
 
     int groupnum = -1;
 
@@ -239,6 +312,7 @@ static void cb_group_invite(Tox *m, uint32_t friendnumber, TOX_CONFERENCE_TYPE t
     }
 
     log_timestamp("Accepted groupchat invite from %s [%d]", name, groupnum);
+    request_groups_save();
     return;
 
 on_error:
@@ -248,17 +322,20 @@ on_error:
 static void cb_group_titlechange(Tox *m, uint32_t groupnumber, uint32_t peernumber, const uint8_t *title,
                                  size_t length, void *userdata)
 {
-    char message[TOX_MAX_MESSAGE_LENGTH];
-    length = copy_tox_str(message, sizeof(message), (const char *) title, length);
+    group_set_title(groupnumber, (const char *) title, length);
+    request_groups_save();
+}
 
-    int idx = group_index(groupnumber);
+static void cb_group_peer_list_changed(Tox *m, uint32_t groupnumber, void *userdata)
+{
+    TOX_ERR_CONFERENCE_PEER_QUERY err;
+    uint32_t num_peers = tox_conference_peer_count(m, groupnumber, &err);
 
-    if (idx == -1) {
-        return;
+    if (err != TOX_ERR_CONFERENCE_PEER_QUERY_OK) {
+        num_peers = 0;
     }
 
-    memcpy(Tox_Bot.g_chats[idx].title, message, length + 1);
-    Tox_Bot.g_chats[idx].title_len = length;
+    group_set_peer_count(groupnumber, num_peers);
 }
 /* END CALLBACKS */
 
@@ -268,29 +345,22 @@ int save_data(Tox *m, const char *path)
         goto on_error;
     }
 
-    FILE *fp = fopen(path, "wb");
-
-    if (fp == NULL) {
-        return -1;
-    }
-
     size_t data_len = tox_get_savedata_size(m);
-    char *data = malloc(data_len);
+    uint8_t *data = malloc(data_len);
 
     if (data == NULL) {
         goto on_error;
     }
 
-    tox_get_savedata(m, (uint8_t *) data);
+    tox_get_savedata(m, data);
 
-    if (fwrite(data, data_len, 1, fp) != 1) {
-        free(data);
-        fclose(fp);
+    int ret = save_profile_data(path, data, data_len);
+    free(data);
+
+    if (ret != 0) {
         goto on_error;
     }
 
-    free(data);
-    fclose(fp);
     return 0;
 
 on_error:
@@ -298,12 +368,149 @@ on_error:
     return -1;
 }
 
-static Tox *load_tox(struct Tox_Options *options, char *path)
+void request_save(void)
+{
+    ++Tox_Bot.saves_requested;
+    Tox_Bot.save_pending = true;
+}
+
+/*
+ * Hands a snapshot of the profile to the saver thread if a save was requested and we haven't saved
+ * within the last SAVE_INTERVAL seconds.
+ */
+static void flush_data(Tox *m, time_t cur_time)
+{
+    if (saver_poll_failed()) {
+        Tox_Bot.save_pending = true;
+    }
+
+    if (!Tox_Bot.save_pending || !timed_out(Tox_Bot.last_save, cur_time, SAVE_INTERVAL)) {
+        return;
+    }
+
+    /* on failure we retry after the next interval rather than every iteration */
+    Tox_Bot.last_save = cur_time;
+
+    if (saver_submit(m) == 0) {
+        Tox_Bot.save_pending = false;
+    }
+}
+
+/*
+ * Reads the data file passphrase into `buf` from the file given with --passphrase-file, or from the
+ * PASSPHRASE_ENV environment variable. A trailing newline is not part of the passphrase.
+ *
+ * Returns the length of the passphrase, or 0 if none was given.
+ * Returns -1 if the passphrase file can't be read or the passphrase doesn't fit in `size - 1` bytes.
+ */
+static int load_passphrase(char *buf, size_t size)
+{
+    /* a passphrase of the maximum length followed by "\r\n" */
+    char scratch[MAX_PASSPHRASE_LENGTH + 1];
+    const char *passphrase;
+    size_t len;
+    bool more = false;
+
+    if (Options.passphrase_file[0] != '\0') {
+        FILE *fp = fopen(Options.passphrase_file, "r");
+
+        if (fp == NULL) {
+            fprintf(stderr, "Failed to open passphrase file '%s'\n", Options.passphrase_file);
+            return -1;
+        }
+
+        /* unbuffered, so that no copy of the passphrase is left behind in a stdio buffer */
+        setvbuf(fp, NULL, _IONBF, 0);
+
+        /* anything past a passphrase of size - 1 bytes and its line ending means it's too long */
+        len = fread(scratch, 1, MIN(size + 1, sizeof(scratch)), fp);
+        more = fgetc(fp) != EOF;
+        fclose(fp);
+
+        passphrase = scratch;
+    } else {
+        passphrase = getenv(PASSPHRASE_ENV);
+
+        if (passphrase == NULL) {
+            return 0;
+        }
+
+        len = strlen(passphrase);
+    }
+
+    while (len > 0 && (passphrase[len - 1] == '\n' || passphrase[len - 1] == '\r')) {
+        --len;
+    }
+
+    int ret = -1;
+
+    if (more || len > size - 1) {
+        fprintf(stderr, "Passphrase is too long (max %zu bytes)\n", size - 1);
+    } else {
+        memcpy(buf, passphrase, len);
+        buf[len] = '\0';
+        ret = len;
+    }
+
+    secure_zero(scratch, sizeof(scratch));
+
+    return ret;
+}
+
+/*
+ * Decrypts the encrypted profile in `data`, caching the key derived from `passphrase` for future saves.
+ *
+ * Returns a newly allocated buffer holding the plaintext profile and sets `plain_len` to its length.
+ * Returns NULL on failure.
+ */
+static uint8_t *decrypt_profile(const uint8_t *data, size_t data_len, const char *passphrase, size_t pass_len,
+                                size_t *plain_len)
+{
+    if (pass_len == 0) {
+        fprintf(stderr, "tox_new failed: toxbot save file is encrypted; set %s or use --passphrase-file\n",
+                PASSPHRASE_ENV);
+        return NULL;
+    }
+
+    uint8_t salt[TOX_PASS_SALT_LENGTH];
+
+    if (data_len <= TOX_PASS_ENCRYPTION_EXTRA_LENGTH || !tox_get_salt(data, salt, NULL)) {
+        fprintf(stderr, "tox_new failed: encrypted toxbot save file is corrupt\n");
+        return NULL;
+    }
+
+    if (saver_set_passphrase((const uint8_t *) passphrase, pass_len, salt) != 0) {
+        return NULL;
+    }
+
+    *plain_len = data_len - TOX_PASS_ENCRYPTION_EXTRA_LENGTH;
+    uint8_t *plaintext = malloc(*plain_len);
+
+    if (plaintext == NULL) {
+        return NULL;
+    }
+
+    Tox_Err_Decryption err;
+
+    if (!tox_pass_key_decrypt(saver_get_pass_key(), data, data_len, plaintext, &err)) {
+        fprintf(stderr, "tox_new failed: could not decrypt toxbot save file (wrong passphrase?)\n");
+        free(plaintext);
+        return NULL;
+    }
+
+    return plaintext;
+}
+
+static Tox *load_tox_data(struct Tox_Options *options, char *path, const char *passphrase, int pass_len)
 {
-    FILE *fp = fopen(path, "rb");
+    int fd = open(path, O_RDONLY);
     Tox *m = NULL;
 
-    if (fp == NULL) {
+    if (fd == -1) {
+        if (pass_len > 0 && saver_set_passphrase((const uint8_t *) passphrase, pass_len, NULL) != 0) {
+            return NULL;
+        }
+
         TOX_ERR_NEW err;
         m = tox_new(options, &err);
 
@@ -316,34 +523,102 @@ static Tox *load_tox(struct Tox_Options *options, char *path)
         return m;
     }
 
-    off_t data_len = file_size(path);
+    struct stat st;
 
-    if (data_len == 0) {
-        fprintf(stderr, "tox_new failed: toxbot save file is empty\n");
-        fclose(fp);
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "tox_new failed: toxbot save file is not a regular file\n");
+        close(fd);
         return NULL;
     }
 
-    char data[data_len];
+    if (st.st_size < DATA_FILE_MIN_SIZE) {
+        fprintf(stderr, "tox_new failed: toxbot save file is %s\n", st.st_size == 0 ? "empty" : "truncated");
+        close(fd);
+        return NULL;
+    }
 
-    if (fread(data, sizeof(data), 1, fp) != 1) {
-        fclose(fp);
+    if (st.st_size > DATA_FILE_MAX_SIZE) {
+        fprintf(stderr, "tox_new failed: toxbot save file is too large (%jd bytes)\n", (intmax_t) st.st_size);
+        close(fd);
+        return NULL;
+    }
+
+    uint64_t start = get_monotonic_time();
+
+    /* toxcore copies what it needs out of the savedata, so the file is mapped only while tox_new() runs */
+    size_t data_len = st.st_size;
+    void *data = mmap(NULL, data_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "tox_new failed: could not map toxbot save file (error %d)\n", errno);
         return NULL;
     }
 
+    const uint8_t *savedata = data;
+    size_t savedata_len = data_len;
+    uint8_t *plaintext = NULL;
+    bool encrypted = tox_is_data_encrypted(data);
+
+    if (encrypted) {
+        plaintext = decrypt_profile(data, data_len, passphrase, pass_len, &savedata_len);
+
+        if (plaintext == NULL) {
+            munmap(data, data_len);
+            return NULL;
+        }
+
+        savedata = plaintext;
+    }
+
     TOX_ERR_NEW err;
     options->savedata_type = TOX_SAVEDATA_TYPE_TOX_SAVE;
-    options->savedata_data = (uint8_t *) data;
-    options->savedata_length = data_len;
+    options->savedata_data = savedata;
+    options->savedata_length = savedata_len;
 
     m = tox_new(options, &err);
 
+    options->savedata_data = NULL;
+    options->savedata_length = 0;
+    munmap(data, data_len);
+    free(plaintext);
+
     if (err != TOX_ERR_NEW_OK) {
         fprintf(stderr, "tox_new failed with error %d\n", err);
         return NULL;
     }
 
-    fclose(fp);
+    uint64_t elapsed = get_monotonic_time() - start;
+    printf("Loaded %zu byte %sprofile in %"PRIu64".%03"PRIu64" ms\n", data_len, encrypted ? "encrypted " : "",
+           elapsed / 1000, elapsed % 1000);
+
+    /* A passphrase given for a plaintext profile encrypts it from now on */
+    if (!encrypted && pass_len > 0) {
+        if (saver_set_passphrase((const uint8_t *) passphrase, pass_len, NULL) != 0 || save_data(m, path) != 0) {
+            tox_kill(m);
+            return NULL;
+        }
+
+        printf("Encrypted toxbot save file\n");
+    }
+
+    return m;
+}
+
+static Tox *load_tox(struct Tox_Options *options, char *path)
+{
+    char passphrase[MAX_PASSPHRASE_LENGTH];
+    int pass_len = load_passphrase(passphrase, sizeof(passphrase));
+
+    if (pass_len < 0) {
+        return NULL;
+    }
+
+    Tox *m = load_tox_data(options, path, passphrase, pass_len);
+
+    /* the derived key is all the saver needs from here on */
+    secure_zero(passphrase, sizeof(passphrase));
+
     return m;
 }
 
@@ -385,14 +660,51 @@ static void load_conferences(Tox *m)
     free(chatlist);
 }
 
+/*
+ * Restores group passwords, titles and bot-wide settings from the group store. This must be called
+ * after load_conferences().
+ */
+static void load_groups_store(Tox *m)
+{
+    struct Group_Store_Settings settings = {
+        .default_groupnum = Tox_Bot.default_groupnum,
+        .inactive_limit = Tox_Bot.inactive_limit,
+    };
+
+    uint64_t start = get_monotonic_time();
+    int restored = group_store_load(m, GROUPS_STORE, &settings);
+
+    if (restored == -1) {
+        if (file_exists(GROUPS_STORE)) {
+            fprintf(stderr, "Warning: ignoring invalid group store '%s'\n", GROUPS_STORE);
+        }
+
+        return;
+    }
+
+    Tox_Bot.default_groupnum = settings.default_groupnum;
+    Tox_Bot.inactive_limit = settings.inactive_limit;
+
+    /* rewrite it under the pass key in case it was saved before the passphrase was set */
+    if (saver_get_pass_key() != NULL) {
+        request_groups_save();
+    }
+
+    uint64_t elapsed = get_monotonic_time() - start;
+    printf("Restored %d groups in %"PRIu64".%03"PRIu64" ms\n", restored, elapsed / 1000, elapsed % 1000);
+}
+
 static void print_usage(void)
 {
     printf("usage: toxbot [OPTION] ...\n");
     printf("    -4, --ipv4              Force IPv4\n");
     printf("    -h, --help              Show this message and exit\n");
     printf("    -L, --no-lan            Disable LAN\n");
+    printf("    -m, --max-friends       Maximum number of friends. Requires: [number]\n");
     printf("    -P, --HTTP-proxy        Use HTTP proxy. Requires: [IP] [port]\n");
     printf("    -p, --SOCKS5-proxy      Use SOCKS proxy. Requires: [IP] [port]\n");
+    printf("    -f, --passphrase-file   Encrypt the save file with the passphrase in this file.\n");
+    printf("                            Defaults to the %s environment variable\n", PASSPHRASE_ENV);
     printf("    -t, --force-tcp         Force connections through TCP relays (DHT disabled)\n");
 }
 
@@ -413,14 +725,16 @@ static void parse_args(int argc, char *argv[])
     static struct option long_opts[] = {
         {"ipv4", no_argument, 0, '4'},
         {"help", no_argument, 0, 'h'},
+        {"passphrase-file", required_argument, 0, 'f'},
         {"no-lan", no_argument, 0, 'L'},
+        {"max-friends", required_argument, 0, 'm'},
         {"SOCKS5-proxy", required_argument, 0, 'p'},
         {"HTTP-proxy", required_argument, 0, 'P'},
         {"force-tcp", no_argument, 0, 't'},
         {NULL, no_argument, NULL, 0},
     };
 
-    const char *options_string = "4hLtp:P:";
+    const char *options_string = "4f:hLm:tp:P:";
     int opt = 0;
     int indexptr = 0;
 
@@ -432,12 +746,31 @@ static void parse_args(int argc, char *argv[])
                 break;
             }
 
+            case 'f': {
+                snprintf(Options.passphrase_file, sizeof(Options.passphrase_file), "%s", optarg);
+                printf("Option set: Passphrase file %s\n", optarg);
+                break;
+            }
+
             case 'L': {
                 Options.disable_lan = true;
                 printf("Option set: LAN disabled\n");
                 break;
             }
 
+            case 'm': {
+                long int max_friends = strtol(optarg, NULL, 10);
+
+                if (max_friends <= 0 || max_friends > UINT32_MAX) {
+                    fprintf(stderr, "Invalid maximum number of friends\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                Options.max_friends = max_friends;
+                printf("Option set: Maximum %ld friends\n", max_friends);
+                break;
+            }
+
             case 'p': {
                 Options.proxy_type = TOX_PROXY_TYPE_SOCKS5;
             }
@@ -535,10 +868,12 @@ static Tox *init_tox(void)
 
     tox_callback_self_connection_status(m, cb_self_connection_change);
     tox_callback_friend_connection_status(m, cb_friend_connection_change);
+    tox_callback_friend_name(m, cb_friend_name);
     tox_callback_friend_request(m, cb_friend_request);
     tox_callback_friend_message(m, cb_friend_message);
     tox_callback_conference_invite(m, cb_group_invite);
     tox_callback_conference_title(m, cb_group_titlechange);
+    tox_callback_conference_peer_list_changed(m, cb_group_peer_list_changed);
 
     size_t s_len = tox_self_get_status_message_size(m);
 
@@ -587,22 +922,25 @@ static struct toxNodes {
 static void bootstrap_DHT(Tox *m)
 {
     for (int i = 0; nodes[i].ip; ++i) {
-        char *key = hex_string_to_bin(nodes[i].key);
+        uint8_t key[TOX_PUBLIC_KEY_SIZE];
+
+        if (hex_decode(key, sizeof(key), nodes[i].key) != 0) {
+            fprintf(stderr, "Failed to bootstrap DHT: %s %d (invalid key)\n", nodes[i].ip, nodes[i].port);
+            continue;
+        }
 
         TOX_ERR_BOOTSTRAP err;
-        tox_bootstrap(m, nodes[i].ip, nodes[i].port, (uint8_t *) key, &err);
+        tox_bootstrap(m, nodes[i].ip, nodes[i].port, key, &err);
 
         if (err != TOX_ERR_BOOTSTRAP_OK) {
             fprintf(stderr, "Failed to bootstrap DHT: %s %d (error %d)\n", nodes[i].ip, nodes[i].port, err);
         }
 
-        tox_add_tcp_relay(m, nodes[i].ip, nodes[i].port, (uint8_t *) key, &err);
+        tox_add_tcp_relay(m, nodes[i].ip, nodes[i].port, key, &err);
 
         if (err != TOX_ERR_BOOTSTRAP_OK) {
             fprintf(stderr, "Failed to add TCP relay: %s %d (error %d)\n", nodes[i].ip, nodes[i].port, err);
         }
-
-        free(key);
     }
 }
 
@@ -610,18 +948,13 @@ static void print_profile_info(Tox *m)
 {
     printf("Tox_Bot version %s\n", VERSION);
     printf("Toxcore version %d.%d.%d\n", tox_version_major(), tox_version_minor(), tox_version_patch());
-    printf("Tox ID: ");
 
-    char address[TOX_ADDRESS_SIZE];
-    tox_self_get_address(m, (uint8_t *) address);
+    uint8_t address[TOX_ADDRESS_SIZE];
+    char address_str[TOX_ADDRESS_SIZE * 2 + 1];
+    tox_self_get_address(m, address);
+    hex_encode(address_str, address, TOX_ADDRESS_SIZE);
 
-    for (int i = 0; i < TOX_ADDRESS_SIZE; ++i) {
-        char d[3];
-        snprintf(d, sizeof(d), "%02X", address[i] & 0xff);
-        printf("%s", d);
-    }
-
-    printf("\n");
+    printf("Tox ID: %s\n", address_str);
 
     char name[TOX_MAX_NAME_LENGTH];
     size_t len = tox_self_get_name_size(m);
@@ -636,70 +969,62 @@ static void print_profile_info(Tox *m)
     printf("Active groups: %lu\n", num_chats);
 }
 
-static void purge_inactive_friends(Tox *m)
+/*
+ * Deletes friends that have been offline for longer than the inactive limit, oldest first, until
+ * FRIEND_PURGE_TIME_BUDGET microseconds have passed. `num_purged` is incremented for each deletion.
+ *
+ * Returns true once no inactive friends remain.
+ */
+static bool purge_inactive_friends(Tox *m, uint32_t *num_purged)
 {
-    size_t numfriends = tox_self_get_friend_list_size(m);
-
-    if (numfriends == 0) {
-        return;
-    }
-
-    uint32_t friend_list[numfriends];
-    tox_self_get_friend_list(m, friend_list);
-
-    for (size_t i = 0; i < numfriends; ++i) {
-        uint32_t friendnum = friend_list[i];
-
-        if (!tox_friend_exists(m, friendnum)) {
-            continue;
-        }
+    uint64_t start = get_monotonic_time();
+    uint64_t now = get_time();
+    uint64_t cutoff = now > Tox_Bot.inactive_limit ? now - Tox_Bot.inactive_limit : 0;
+    uint32_t friendnum;
 
+    while (friends_get_inactive(cutoff, &friendnum)) {
         TOX_ERR_FRIEND_GET_LAST_ONLINE err;
         uint64_t last_online = tox_friend_get_last_online(m, friendnum, &err);
 
         if (err != TOX_ERR_FRIEND_GET_LAST_ONLINE_OK) {
-            continue;
+            friend_reset(friendnum);
+        } else if (last_online >= cutoff) {
+            /* the queue is behind toxcore's record; requeue with the real time */
+            friend_set_last_online(friendnum, last_online);
+        } else {
+            tox_friend_delete(m, friendnum, NULL);
+            friend_reset(friendnum);
+            ++*num_purged;
         }
 
-        if (get_time() - last_online > Tox_Bot.inactive_limit) {
-            tox_friend_delete(m, friendnum, NULL);
+        if (get_monotonic_time() - start >= FRIEND_PURGE_TIME_BUDGET) {
+            return false;
         }
     }
+
+    return true;
 }
 
-static void purge_empty_groups(Tox *m)
+/* Leaves the groups that have been empty for at least GROUP_EMPTY_GRACE seconds. */
+static void purge_empty_groups(Tox *m, time_t cur_time)
 {
-    for (uint32_t i = 0; i < Tox_Bot.chats_idx; ++i) {
-        if (!Tox_Bot.g_chats[i].active) {
-            continue;
-        }
-
-        TOX_ERR_CONFERENCE_PEER_QUERY err;
-        uint32_t num_peers = tox_conference_peer_count(m, Tox_Bot.g_chats[i].groupnum, &err);
+    int64_t groupnum;
 
-        if (err != TOX_ERR_CONFERENCE_PEER_QUERY_OK || num_peers <= 1) {
-            log_timestamp("Deleting empty group %d", Tox_Bot.g_chats[i].groupnum);
-            tox_conference_delete(m, Tox_Bot.g_chats[i].groupnum, NULL);
-            group_leave(i);
-
-            if (i >= Tox_Bot.chats_idx) {   // group_leave modifies chats_idx
-                return;
-            }
-        }
+    while ((groupnum = group_pop_expired(cur_time, GROUP_EMPTY_GRACE)) != -1) {
+        log_timestamp("Deleting empty group %"PRId64, groupnum);
+        tox_conference_delete(m, groupnum, NULL);
+        group_leave(groupnum);
+        request_groups_save();
     }
 }
 
 /* Return true if we should attempt to purge empty groups.
  *
- * Empty groups are purged on an interval, but only if we have a stable connection
- * to the Tox network.
+ * Groups are only known to be empty if we have a stable connection to the Tox network;
+ * until then their peers may simply not have reconnected yet.
  */
-static bool check_group_purge(time_t last_group_purge, time_t cur_time, TOX_CONNECTION connection_status)
+static bool check_group_purge(time_t cur_time, TOX_CONNECTION connection_status)
 {
-    if (!timed_out(last_group_purge, cur_time, GROUP_PURGE_INTERVAL)) {
-        return false;
-    }
-
     if (connection_status == TOX_CONNECTION_NONE) {
         return false;
     }
@@ -758,13 +1083,29 @@ int main(int argc, char **argv)
     }
 
     init_toxbot_state();
+    saver_init(DATA_FILE);
+
+    if (commands_init(m) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    requests_init();
+
+    if (friends_init(m) != 0) {
+        fprintf(stderr, "Warning: failed to initialize friend list (out of memory)\n");
+    }
+    key_list_init(&Tox_Bot.master_keys, MASTERLIST_FILE, MASTERLIST_STORE, false);
+    key_list_init(&Tox_Bot.blocked_keys, BLOCKLIST_FILE, BLOCKLIST_STORE, true);
     load_conferences(m);
+    load_groups_store(m);
     print_profile_info(m);
 
     time_t cur_time = get_time();
 
     uint64_t last_friend_purge = cur_time;
-    uint64_t last_group_purge = cur_time;
+    uint64_t last_friend_check = cur_time;
+    bool purging_friends = false;
+    uint32_t num_purged = 0;
 
     while (!FLAG_EXIT) {
         TOX_CONNECTION connection_status = tox_self_get_connection_status(m);
@@ -777,17 +1118,45 @@ int main(int argc, char **argv)
         }
 
         if (connection_status != TOX_CONNECTION_NONE && timed_out(last_friend_purge, cur_time, FRIEND_PURGE_INTERVAL)) {
-            purge_inactive_friends(m);
-            save_data(m, DATA_FILE);
+            purging_friends = true;
             last_friend_purge = cur_time;
         }
 
-        if (check_group_purge(last_group_purge, cur_time, connection_status)) {
-            purge_empty_groups(m);
-            last_group_purge = cur_time;
+        /* A purge cycle may span many iterations; the data file is saved once when it completes */
+        if (purging_friends && purge_inactive_friends(m, &num_purged)) {
+            if (num_purged > 0) {
+                log_timestamp("Purged %"PRIu32" inactive friends", num_purged);
+                request_save();
+            }
+
+            purging_friends = false;
+            num_purged = 0;
+        }
+
+        if (requests_process(m) > 0) {
+            request_save();
         }
 
+        broadcast_process(m);
+        outbox_process(m);
+
+        if (timed_out(last_friend_check, cur_time, FRIEND_CHECK_INTERVAL)) {
+            friends_check_online(m);
+            last_friend_check = cur_time;
+        }
+
+        if (check_group_purge(cur_time, connection_status)) {
+            purge_empty_groups(m, cur_time);
+        }
+
+        key_list_poll();
+
+        uint64_t iterate_start = get_monotonic_time();
         tox_iterate(m, NULL);
+        overload_record_iterate(get_monotonic_time() - iterate_start);
+
+        flush_data(m, cur_time);
+        flush_groups_store(m, cur_time);
 
         usleep(tox_iteration_interval(m) * 1000);
 
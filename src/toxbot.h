@@ -26,12 +26,16 @@
 #include <stdint.h>
 #include <tox/tox.h>
 #include "groupchats.h"
+#include "keylist.h"
 
-#define MAX_NUM_GROUPS 256
+#define VERSION "0.1.2"
 
 #define DATA_FILE        "toxbot.tox"
 #define MASTERLIST_FILE  "masterkeys"
 #define BLOCKLIST_FILE   "blockedkeys"
+#define MASTERLIST_STORE "masterkeys.db"
+#define BLOCKLIST_STORE  "blockedkeys.db"
+#define GROUPS_STORE     "groups.db"
 
 struct Tox_Bot {
     time_t     start_time;  // time toxbot was started
@@ -40,13 +44,41 @@ struct Tox_Bot {
     uint64_t   inactive_limit;  // how often we purge inactive contacts
     int        default_groupnum;  // the group that invite commands with no ID default to
     int        num_online_friends;
-    int        chats_idx;
+    uint32_t   max_friends;  // friend list capacity; 0 for unlimited
 
-    struct Group_Chat *g_chats;
+    bool       save_pending;  // true if the data file is out of date
+    time_t     last_save;  // time the data file was last written
+    uint64_t   saves_requested;
+
+    bool       groups_save_pending;  // true if the group metadata file is out of date
+    time_t     last_groups_save;
+
+    struct Key_List    master_keys;
+    struct Key_List    blocked_keys;
 };
 
 int load_Masters(const char *path);
+/*
+ * Atomically replaces the data file at `path` with the current Tox profile. This blocks until the
+ * file is on disk; the main loop uses request_save() instead.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
 int save_data(Tox *m, const char *path);
+
+/*
+ * Marks the data file as out of date. It's written from the main loop, at most once every few
+ * seconds, so that bursts of changes cost a single write.
+ */
+void request_save(void);
+
+/*
+ * Marks the group metadata file, which also holds bot-wide settings, as out of date. Like the data
+ * file it's written from the main loop.
+ */
+void request_groups_save(void);
+
 bool friend_is_master(Tox *m, uint32_t friendnumber);
 
 #endif /* TOXBOT_H */
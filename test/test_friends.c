@@ -0,0 +1,201 @@
+/*  test_friends.c
+ *
+ *
+ *  Copyright (C) 2021 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Tests for the friend state tracking. toxcore is replaced by the stubs below, which report whatever
+ * connection status the test sets, so the online count check can be made to find mismatches.
+ *
+ * Build and run with `make test-friends`.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/friends.h"
+#include "../src/keylist.h"
+#include "../src/misc.h"
+#include "../src/outbox.h"
+#include "../src/toxbot.h"
+
+#define NUM_FRIENDS 4
+
+struct Tox_Bot Tox_Bot;
+
+static TOX_CONNECTION connection[NUM_FRIENDS];
+static uint64_t last_online[NUM_FRIENDS];
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        ++failures; \
+    } \
+} while (0)
+
+size_t tox_self_get_friend_list_size(const Tox *tox)
+{
+    return NUM_FRIENDS;
+}
+
+void tox_self_get_friend_list(const Tox *tox, uint32_t *friend_list)
+{
+    for (uint32_t i = 0; i < NUM_FRIENDS; ++i) {
+        friend_list[i] = i;
+    }
+}
+
+TOX_CONNECTION tox_friend_get_connection_status(const Tox *tox, uint32_t friend_number,
+        Tox_Err_Friend_Query *error)
+{
+    return connection[friend_number];
+}
+
+uint64_t tox_friend_get_last_online(const Tox *tox, uint32_t friend_number, TOX_ERR_FRIEND_GET_LAST_ONLINE *error)
+{
+    if (error != NULL) {
+        *error = TOX_ERR_FRIEND_GET_LAST_ONLINE_OK;
+    }
+
+    return last_online[friend_number];
+}
+
+bool tox_friend_get_public_key(const Tox *tox, uint32_t friend_number, uint8_t *public_key,
+                               Tox_Err_Friend_Get_Public_Key *error)
+{
+    memset(public_key, friend_number, TOX_PUBLIC_KEY_SIZE);
+    return true;
+}
+
+size_t tox_friend_get_name_size(const Tox *tox, uint32_t friend_number, Tox_Err_Friend_Query *error)
+{
+    return 0;
+}
+
+bool tox_friend_get_name(const Tox *tox, uint32_t friend_number, uint8_t *name, Tox_Err_Friend_Query *error)
+{
+    return true;
+}
+
+bool key_list_contains(const struct Key_List *list, const uint8_t *public_key)
+{
+    return false;
+}
+
+void outbox_clear(uint32_t friendnumber)
+{
+}
+
+/* Sets up NUM_FRIENDS friends that were all last online well before now, with every friend offline */
+static void reset(void)
+{
+    friends_free();
+    memset(&Tox_Bot, 0, sizeof(Tox_Bot));
+
+    for (uint32_t i = 0; i < NUM_FRIENDS; ++i) {
+        connection[i] = TOX_CONNECTION_NONE;
+        last_online[i] = 1000 + i;
+    }
+
+    CHECK(friends_init(NULL) == 0);
+}
+
+/* A friend tracked as online that toxcore reports offline must go back into the inactivity queue */
+static void test_missed_offline(void)
+{
+    reset();
+
+    for (uint32_t i = 0; i < NUM_FRIENDS; ++i) {
+        connection[i] = TOX_CONNECTION_UDP;
+        friend_set_connection_status(i, TOX_CONNECTION_UDP);
+    }
+
+    uint32_t friendnumber;
+    CHECK(!friends_get_inactive(UINT64_MAX, &friendnumber));
+
+    /* friend 2 drops without the bot seeing the connection change */
+    connection[2] = TOX_CONNECTION_NONE;
+    time_t before = get_time();
+    friends_check_online(NULL);
+
+    CHECK(Tox_Bot.num_online_friends == NUM_FRIENDS - 1);
+    CHECK(!friends_get_inactive(before, &friendnumber));
+    CHECK(friends_get_inactive(UINT64_MAX, &friendnumber) && friendnumber == 2);
+
+    /* once back in step, a real reconnect must take it out of the queue again */
+    connection[2] = TOX_CONNECTION_TCP;
+    friend_set_connection_status(2, TOX_CONNECTION_TCP);
+
+    CHECK(Tox_Bot.num_online_friends == NUM_FRIENDS);
+    CHECK(!friends_get_inactive(UINT64_MAX, &friendnumber));
+}
+
+/* A friend tracked as offline that toxcore reports online must leave the inactivity queue */
+static void test_missed_online(void)
+{
+    reset();
+
+    uint32_t friendnumber;
+    CHECK(friends_get_inactive(UINT64_MAX, &friendnumber) && friendnumber == 0);
+
+    /* friend 0, the longest inactive, comes online without the bot seeing the connection change */
+    connection[0] = TOX_CONNECTION_UDP;
+    friends_check_online(NULL);
+
+    CHECK(Tox_Bot.num_online_friends == 1);
+    CHECK(friends_get_inactive(UINT64_MAX, &friendnumber) && friendnumber == 1);
+
+    /* the later disconnect must be counted and requeue it with a fresh last online time */
+    time_t before = get_time();
+    connection[0] = TOX_CONNECTION_NONE;
+    friend_set_connection_status(0, TOX_CONNECTION_NONE);
+
+    CHECK(Tox_Bot.num_online_friends == 0);
+    CHECK(friends_get_inactive(UINT64_MAX, &friendnumber) && friendnumber == 1);
+
+    for (uint32_t i = 1; i < NUM_FRIENDS; ++i) {
+        friend_reset(i);
+    }
+
+    CHECK(!friends_get_inactive(before, &friendnumber));
+    CHECK(friends_get_inactive(UINT64_MAX, &friendnumber) && friendnumber == 0);
+}
+
+int main(void)
+{
+    test_missed_offline();
+    test_missed_online();
+
+    friends_free();
+
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("friends: all checks passed\n");
+
+    return 0;
+}